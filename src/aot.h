@@ -0,0 +1,33 @@
+#pragma once
+
+#include "chip8.h"
+#include <cstddef>
+#include <cstdint>
+
+// A block of a ROM compiled ahead of time by chip8-aot. Like a JitBlock it
+// runs 'count' straight-line instructions and leaves pc at the next one to
+// run, but it is ordinary C++ built into the binary.
+struct AotBlock {
+  void (*code)(Chip8State &state);
+  uint16_t count;
+  uint16_t loopJump; // address of the final 1nnn when it jumps backwards
+  bool loopCheck;    // the block ends with such a jump
+};
+
+// A ROM compiled by chip8-aot (see src/aot_compiler.cpp): the image it was
+// compiled from, the quirk profile the blocks implement, and a block for
+// every address where discovered code starts.
+// Chip8 runs a block only while the memory it covers still holds the bytes
+// it was compiled from; everything else, including the targets of Bnnn,
+// goes to the interpreter.
+struct AotProgram {
+  const char *name;
+  QuirkProfile quirks; // blocks only run on machines with this profile
+  const uint8_t *rom;
+  size_t romSize;
+  const AotBlock *blocks;  // MEMORY_SIZE entries, code is null where none
+  const uint64_t *covered; // MEMORY_SIZE bits, the bytes blocks were built of
+};
+
+// Defined by the translation unit chip8-aot generates
+extern const AotProgram AOT_PROGRAM;
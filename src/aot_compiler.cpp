@@ -0,0 +1,494 @@
+#include "chip8.h"
+#include "movie.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Longest run of instructions compiled into one block, as in the JIT
+const unsigned int MAX_BLOCK_INSTRUCTIONS = 64;
+
+// How an instruction affects control flow, following Chip8::Lookup()
+enum class Flow {
+  Next,     // continues with the next instruction
+  Jump,     // 1nnn
+  Call,     // 2nnn, returns to the next instruction
+  Return,   // 00EE
+  Skip,     // continues with the next instruction or the one after
+  Indirect, // Bnnn, target only known at run time
+  Invalid   // OP_NULL: most likely data, so discovery stops here
+};
+
+Flow FlowOf(uint16_t opcode) {
+  uint8_t low = opcode & 0x00FFu;
+  uint8_t n = opcode & 0x000Fu;
+
+  switch (opcode >> 12) {
+  case 0x0:
+    if ((opcode & 0x0F00u) != 0) {
+      return Flow::Invalid;
+    }
+    if (low == 0xEE) {
+      return Flow::Return;
+    }
+    return low == 0xE0 || (low & 0xF0) == 0xC0 || low == 0xFB || low == 0xFC ||
+                   low == 0xFE || low == 0xFF
+               ? Flow::Next
+               : Flow::Invalid;
+  case 0x1:
+    return Flow::Jump;
+  case 0x2:
+    return Flow::Call;
+  case 0x3:
+  case 0x4:
+  case 0x5:
+  case 0x9:
+    return Flow::Skip;
+  case 0x8:
+    return n <= 0x7 || n == 0xE ? Flow::Next : Flow::Invalid;
+  case 0xB:
+    return Flow::Indirect;
+  case 0xE:
+    return n == 0xE || n == 0x1 ? Flow::Skip : Flow::Invalid;
+  case 0xF:
+    switch (low) {
+    case 0x07:
+    case 0x0A:
+    case 0x15:
+    case 0x18:
+    case 0x1E:
+    case 0x29:
+    case 0x30:
+    case 0x33:
+    case 0x55:
+    case 0x65:
+      return Flow::Next;
+    default:
+      return Flow::Invalid;
+    }
+  default:
+    return Flow::Next;
+  }
+}
+
+std::string Hex(unsigned int value, int digits) {
+  char text[8];
+  std::snprintf(text, sizeof(text), "0x%0*X", digits, value);
+  return text;
+}
+
+std::string Reg(unsigned int r) { return "s.registers[" + Hex(r, 1) + "]"; }
+
+// C++ for the instruction at 'address' under the given quirks, written to
+// 'out'. Returns false for instructions left to the interpreter: those that
+// draw, wait for a key, use the random number generator or write memory, and
+// Bnnn. Sets 'ends' when the instruction transfers control; it then sets pc
+// and returns.
+template <typename Quirks>
+bool Compile(std::ostream &out, uint16_t address, uint16_t opcode,
+             bool &ends) {
+  unsigned int x = (opcode & 0x0F00u) >> 8;
+  unsigned int y = (opcode & 0x00F0u) >> 4;
+  unsigned int kk = opcode & 0x00FFu;
+  unsigned int nnn = opcode & 0x0FFFu;
+  std::string next = Hex(address + 2, 3);
+  std::string skip = Hex(address + 4, 3);
+  std::string Vx = Reg(x);
+  std::string Vy = Reg(y);
+  std::string VF = Reg(0xF);
+  std::string shifted = Quirks::shiftUsesVy ? Vy : Vx;
+  std::string comment = "  // " + Hex(opcode, 4).substr(2) + "\n";
+
+  switch (opcode >> 12) {
+  case 0x0:
+    if (opcode != 0x00EE) {
+      return false;
+    }
+    out << "  --s.sp;" << comment << "  s.pc = s.stack[s.sp];\n  return;\n";
+    ends = true;
+    return true;
+
+  case 0x1:
+    out << "  s.pc = " << Hex(nnn, 3) << ";" << comment << "  return;\n";
+    ends = true;
+    return true;
+
+  case 0x2:
+    out << "  s.stack[s.sp] = " << next << ";" << comment
+        << "  ++s.sp;\n  s.pc = " << Hex(nnn, 3) << ";\n  return;\n";
+    ends = true;
+    return true;
+
+  case 0x3:
+  case 0x4:
+    out << "  s.pc = " << Vx << ((opcode >> 12) == 0x3 ? " == " : " != ")
+        << Hex(kk, 2) << " ? " << skip << " : " << next << ";" << comment
+        << "  return;\n";
+    ends = true;
+    return true;
+
+  case 0x5:
+  case 0x9:
+    out << "  s.pc = " << Vx << ((opcode >> 12) == 0x5 ? " == " : " != ")
+        << Vy << " ? " << skip << " : " << next << ";" << comment
+        << "  return;\n";
+    ends = true;
+    return true;
+
+  case 0x6:
+    out << "  " << Vx << " = " << Hex(kk, 2) << ";" << comment;
+    return true;
+
+  case 0x7:
+    out << "  " << Vx << " += " << Hex(kk, 2) << ";" << comment;
+    return true;
+
+  case 0x8:
+    switch (opcode & 0x000Fu) {
+    case 0x0:
+      out << "  " << Vx << " = " << Vy << ";" << comment;
+      return true;
+    case 0x1:
+      out << "  " << Vx << " |= " << Vy << ";" << comment;
+      return true;
+    case 0x2:
+      out << "  " << Vx << " &= " << Vy << ";" << comment;
+      return true;
+    case 0x3:
+      out << "  " << Vx << " ^= " << Vy << ";" << comment;
+      return true;
+    case 0x4:
+      // VF is written after Vx, so it wins when x is F
+      out << "  sum = " << Vx << " + " << Vy << ";" << comment << "  " << Vx
+          << " = sum & 0xFF;\n  " << VF << " = sum >> 8;\n";
+      return true;
+    case 0x5:
+    case 0x7: {
+      // VF is written first and the difference uses the updated registers
+      std::string a = (opcode & 0x000Fu) == 0x5 ? Vx : Vy;
+      std::string b = (opcode & 0x000Fu) == 0x5 ? Vy : Vx;
+      out << "  " << VF << " = " << a << " < " << b << " ? 0 : 1;" << comment
+          << "  " << Vx << " = " << a << " - " << b << ";\n";
+      return true;
+    }
+    case 0x6:
+      out << "  " << VF << " = " << shifted << " & 1;" << comment << "  "
+          << Vx << " = " << shifted << " >> 1;\n";
+      return true;
+    case 0xE:
+      out << "  " << VF << " = " << shifted << " >> 7;" << comment << "  "
+          << Vx << " = " << shifted << " << 1;\n";
+      return true;
+    default:
+      return false;
+    }
+
+  case 0xA:
+    out << "  s.index = " << Hex(nnn, 3) << ";" << comment;
+    return true;
+
+  case 0xE:
+    if (kk != 0x9E && kk != 0xA1) {
+      return false;
+    }
+    out << "  s.pc = " << (kk == 0x9E ? "" : "!") << "s.keypad[" << Vx
+        << "] ? " << skip << " : " << next << ";" << comment
+        << "  return;\n";
+    ends = true;
+    return true;
+
+  case 0xF:
+    switch (kk) {
+    case 0x07:
+      // The timers only change between frames, never inside Run()
+      out << "  " << Vx << " = s.delayTimer;" << comment;
+      return true;
+    case 0x15:
+      out << "  s.delayTimer = " << Vx << ";" << comment;
+      return true;
+    case 0x18:
+      out << "  s.soundTimer = " << Vx << ";" << comment;
+      return true;
+    case 0x1E:
+      out << "  s.index += " << Vx << ";" << comment;
+      return true;
+    case 0x29:
+      out << "  s.index = " << Vx << " * 5 + " << Hex(FONTSET_START_ADDRESS, 2)
+          << ";" << comment;
+      return true;
+    case 0x30:
+      out << "  s.index = (" << Vx << " & 0xF) * 10 + "
+          << Hex(BIG_FONTSET_START_ADDRESS, 2) << ";" << comment;
+      return true;
+    case 0x65:
+      for (unsigned int i = 0; i <= x; ++i) {
+        out << "  " << Reg(i) << " = s.memory[(s.index + " << i
+            << ") & (MEMORY_SIZE - 1)];"
+            << (i == 0 ? comment : "\n");
+      }
+      if (Quirks::loadStoreIncrementsIndex) {
+        out << "  s.index += " << x + 1 << ";\n";
+      }
+      return true;
+    default:
+      return false;
+    }
+
+  default:
+    return false;
+  }
+}
+
+bool Compile(std::ostream &out, uint16_t address, uint16_t opcode, bool &ends,
+             QuirkProfile quirks) {
+  switch (quirks) {
+  case QuirkProfile::Vip:
+    return Compile<VipQuirks>(out, address, opcode, ends);
+  case QuirkProfile::Schip:
+    return Compile<SchipQuirks>(out, address, opcode, ends);
+  default:
+    return Compile<ModernQuirks>(out, address, opcode, ends);
+  }
+}
+
+// Turns a ROM into a C++ translation unit defining AOT_PROGRAM (see aot.h)
+class Compiler {
+public:
+  Compiler(const std::vector<uint8_t> &rom, QuirkProfile quirks)
+      : rom(rom), quirks(quirks) {}
+
+  // Walk the control flow from START_ADDRESS, marking every address where a
+  // block has to start: branch and call targets, return addresses, both
+  // sides of skips and whatever follows an interpreted instruction.
+  void Discover() {
+    std::vector<uint16_t> work{uint16_t(START_ADDRESS)};
+    leader[START_ADDRESS] = true;
+
+    while (!work.empty()) {
+      uint16_t address = work.back();
+      work.pop_back();
+
+      for (; InRom(address) && !visited[address]; address += 2) {
+        visited[address] = true;
+        ++reachable;
+        uint16_t opcode = Opcode(address);
+        uint16_t next = address + 2;
+
+        Flow flow = FlowOf(opcode);
+        if (flow == Flow::Jump || flow == Flow::Call) {
+          AddLeader(work, opcode & 0x0FFFu);
+        }
+        if (flow == Flow::Call || flow == Flow::Skip) {
+          AddLeader(work, next);
+        }
+        if (flow == Flow::Skip) {
+          AddLeader(work, next + 2);
+        }
+        if (flow == Flow::Indirect) {
+          ++indirectJumps;
+        }
+        if (flow != Flow::Next) {
+          break;
+        }
+
+        // The interpreter hands back to compiled code right after it
+        bool ends = false;
+        std::ostringstream discard;
+        if (!Compile(discard, address, opcode, ends, quirks)) {
+          leader[next] = true;
+        }
+      }
+    }
+  }
+
+  // Write the blocks, the lookup table and the ROM image. Returns the number
+  // of blocks.
+  unsigned int Write(std::ostream &out, const std::string &name) {
+    out << "// Generated by chip8-aot from " << name
+        << ". Do not edit.\n#include \"aot.h\"\n\nnamespace {\n\n";
+
+    std::vector<bool> covered(MEMORY_SIZE);
+    std::vector<std::string> entries(MEMORY_SIZE, "{}");
+    unsigned int count = 0;
+
+    for (unsigned int start = 0; start < MEMORY_SIZE; ++start) {
+      if (!leader[start] || !InRom(start)) {
+        continue;
+      }
+
+      std::ostringstream body;
+      uint16_t address = start;
+      unsigned int instructions = 0;
+      bool ends = false;
+      while (!ends && instructions < MAX_BLOCK_INSTRUCTIONS &&
+             InRom(address) &&
+             Compile(body, address, Opcode(address), ends, quirks)) {
+        address += 2;
+        ++instructions;
+      }
+      if (instructions == 0) {
+        continue;
+      }
+
+      std::string function = "Block" + Hex(start, 3).substr(2);
+      std::string text = body.str();
+      out << "void " << function << "(Chip8State &s) {\n";
+      if (text.find("sum = ") != std::string::npos) {
+        out << "  unsigned int sum;\n";
+      }
+      out << text;
+      if (!ends) {
+        out << "  s.pc = " << Hex(address, 3) << ";\n";
+      }
+      out << "}\n\n";
+
+      // Backward jumps get the idle loop check, as in OP_1nnn
+      uint16_t last = address - 2;
+      uint16_t opcode = Opcode(last);
+      bool loop = ends && (opcode >> 12) == 0x1 && (opcode & 0x0FFFu) <= last;
+      entries[start] = "{" + function + ", " + std::to_string(instructions) +
+                       ", " + Hex(loop ? last : 0, 3) + ", " +
+                       (loop ? "true" : "false") + "}";
+
+      for (unsigned int a = start; a < address; ++a) {
+        covered[a] = true;
+      }
+      ++count;
+    }
+
+    out << "const AotBlock blocks[MEMORY_SIZE] = {\n";
+    for (unsigned int address = 0; address < MEMORY_SIZE; address += 8) {
+      out << "   ";
+      for (unsigned int i = address; i < address + 8; ++i) {
+        out << " " << entries[i] << ",";
+      }
+      out << "\n";
+    }
+    out << "};\n\nconst uint64_t covered[MEMORY_SIZE / 64] = {\n";
+    for (unsigned int word = 0; word < MEMORY_SIZE / 64; ++word) {
+      uint64_t bits = 0;
+      for (unsigned int bit = 0; bit < 64; ++bit) {
+        bits |= uint64_t(covered[word * 64 + bit]) << bit;
+      }
+      char text[32];
+      std::snprintf(text, sizeof(text), "0x%016llXull,",
+                    static_cast<unsigned long long>(bits));
+      out << (word % 3 == 0 ? "   " : "") << " " << text
+          << (word % 3 == 2 ? "\n" : "");
+    }
+    out << "\n};\n\nconst uint8_t rom[] = {\n";
+    for (size_t i = 0; i < rom.size(); ++i) {
+      out << (i % 12 == 0 ? "   " : "") << " " << Hex(rom[i], 2) << ","
+          << (i % 12 == 11 || i + 1 == rom.size() ? "\n" : "");
+    }
+    out << "};\n\n} // namespace\n\nextern const AotProgram AOT_PROGRAM = {\""
+        << name << "\", QuirkProfile::" << ProfileEnumerator() << ",\n"
+        << "                                      rom, sizeof(rom), blocks, "
+           "covered};\n";
+    return count;
+  }
+
+  unsigned int Reachable() const { return reachable; }
+  unsigned int IndirectJumps() const { return indirectJumps; }
+
+private:
+  const std::vector<uint8_t> &rom;
+  QuirkProfile quirks;
+  bool leader[MEMORY_SIZE]{};
+  bool visited[MEMORY_SIZE]{};
+  unsigned int reachable{};
+  unsigned int indirectJumps{};
+
+  const char *ProfileEnumerator() const {
+    switch (quirks) {
+    case QuirkProfile::Vip:
+      return "Vip";
+    case QuirkProfile::Schip:
+      return "Schip";
+    default:
+      return "Modern";
+    }
+  }
+
+  // Both bytes of the instruction come from the ROM
+  bool InRom(unsigned int address) const {
+    return address >= START_ADDRESS &&
+           address + 2 <= START_ADDRESS + rom.size();
+  }
+
+  uint16_t Opcode(uint16_t address) const {
+    return (rom[address - START_ADDRESS] << 8) |
+           rom[address + 1 - START_ADDRESS];
+  }
+
+  void AddLeader(std::vector<uint16_t> &work, uint16_t address) {
+    if (InRom(address) && !leader[address]) {
+      leader[address] = true;
+      work.push_back(address);
+    }
+  }
+};
+
+} // namespace
+
+// Compiles a ROM ahead of time into a C++ translation unit, to be built into
+// a ROM-specific binary together with src/aot_runner.cpp.
+int main(int argc, char **argv) {
+  QuirkProfile quirks = QuirkProfile::Modern;
+  int arg = 1;
+
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    if (std::strncmp(argv[arg], "--quirks=", 9) == 0) {
+      if (!ParseQuirkProfile(argv[arg] + 9, quirks)) {
+        std::cerr << "Unknown quirk profile: " << argv[arg] + 9 << "\n";
+        return EXIT_FAILURE;
+      }
+    } else {
+      std::cerr << "Unknown option: " << argv[arg] << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - arg != 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--quirks=modern|vip|schip] <ROM> <Output.cpp>\n";
+    return EXIT_FAILURE;
+  }
+  char const *romFilename = argv[arg];
+  char const *outputFilename = argv[arg + 1];
+
+  std::vector<uint8_t> rom;
+  if (!ReadFile(romFilename, rom)) {
+    return EXIT_FAILURE;
+  }
+  if (rom.size() > MEMORY_SIZE - START_ADDRESS) {
+    std::cerr << "ROM too large: " << rom.size() << " bytes\n";
+    return EXIT_FAILURE;
+  }
+
+  // The file name, without directory, names the program
+  std::string name = romFilename;
+  name = name.substr(name.find_last_of("/\\") + 1);
+
+  Compiler compiler(rom, quirks);
+  compiler.Discover();
+
+  std::ofstream out(outputFilename, std::ios::trunc);
+  unsigned int blocks = compiler.Write(out, name);
+  if (!out) {
+    std::cerr << "Failed to write " << outputFilename << "\n";
+    return EXIT_FAILURE;
+  }
+
+  std::cout << name << ": " << compiler.Reachable()
+            << " reachable instructions, " << blocks << " blocks, "
+            << compiler.IndirectJumps()
+            << " indirect jumps left to the interpreter\n";
+  return EXIT_SUCCESS;
+}
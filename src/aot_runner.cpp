@@ -0,0 +1,98 @@
+#include "aot.h"
+#include "chip8.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace {
+
+// Run a budget of 'cycles' instructions of the compiled-in ROM on a fresh
+// machine and return the executed instructions/second achieved
+double Measure(Engine engine, uint32_t seed, unsigned int instructionsPerFrame,
+               uint64_t cycles, uint64_t *executed, uint64_t *hash) {
+  Chip8 chip8;
+  if (!chip8.LoadROM(AOT_PROGRAM.rom, AOT_PROGRAM.romSize)) {
+    std::exit(EXIT_FAILURE);
+  }
+  chip8.SetAotProgram(&AOT_PROGRAM);
+  chip8.SetQuirks(AOT_PROGRAM.quirks);
+  chip8.Seed(seed);
+  chip8.SetEngine(engine);
+  chip8.SetInstructionsPerFrame(instructionsPerFrame);
+
+  auto start = std::chrono::steady_clock::now();
+  chip8.RunFrames(cycles / instructionsPerFrame);
+  chip8.Run(cycles % instructionsPerFrame);
+  auto end = std::chrono::steady_clock::now();
+
+#ifdef CHIP8_PROFILE
+  chip8.WriteProfile(engine == Engine::Aot ? "chip8-profile-aot"
+                                           : "chip8-profile-table");
+#endif
+
+  *executed = chip8.InstructionsExecuted();
+  *hash = chip8.StateHash();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return seconds > 0 ? *executed / seconds : 0.0;
+}
+
+} // namespace
+
+// Runs the ROM that chip8-aot compiled into this binary for a fixed
+// instruction budget, on the compiled blocks and then on the interpreter, and
+// fails unless both end in the same state.
+int main(int argc, char **argv) {
+  uint32_t seed = 1;
+  unsigned int instructionsPerFrame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+  int arg = 1;
+
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    if (std::strncmp(argv[arg], "--seed=", 7) == 0) {
+      seed = std::stoul(argv[arg] + 7);
+    } else if (std::strncmp(argv[arg], "--ipf=", 6) == 0) {
+      instructionsPerFrame = std::stoul(argv[arg] + 6);
+      if (instructionsPerFrame == 0) {
+        std::cerr << "--ipf must be at least 1\n";
+        std::exit(EXIT_FAILURE);
+      }
+    } else {
+      std::cerr << "Unknown option: " << argv[arg] << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - arg != 1) {
+    std::cerr << "Usage: " << argv[0] << " [--seed=N] [--ipf=N] <Cycles>\n"
+              << "Runs " << AOT_PROGRAM.name << ", compiled ahead of time\n";
+    std::exit(EXIT_FAILURE);
+  }
+  uint64_t cycles = std::stoull(argv[arg]);
+
+  struct {
+    const char *name;
+    Engine engine;
+  } const runs[] = {{"aot", Engine::Aot}, {"table", Engine::Table}};
+
+  uint64_t hashes[2];
+  for (int i = 0; i < 2; ++i) {
+    uint64_t executed = 0;
+    double rate = Measure(runs[i].engine, seed, instructionsPerFrame, cycles,
+                          &executed, &hashes[i]);
+    std::cout << std::left << std::setw(10) << runs[i].name << " "
+              << AOT_PROGRAM.name << ", " << executed << "/" << cycles
+              << " instructions executed, "
+              << std::fixed << std::setprecision(1) << rate / 1e6
+              << " M instructions/s, state " << std::hex << hashes[i]
+              << std::dec << "\n";
+    std::cout.unsetf(std::ios::fixed);
+  }
+
+  if (hashes[0] != hashes[1]) {
+    std::cerr << "Compiled code and interpreter disagree\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,51 @@
+#include "beeper.h"
+
+namespace {
+
+const unsigned int TONE_HZ = 440;
+const int16_t AMPLITUDE = 3000;
+const unsigned int MAX_LAG_FRAMES = 2;
+
+} // namespace
+
+void Beeper::Update(uint64_t cycle, bool on) {
+  // The tone changed during the frame that just ended; a full ring (no audio
+  // device draining it) keeps the change pending for the next frame
+  if (on != sent && transitions.TryPush(Transition{frameStart, on})) {
+    sent = on;
+  }
+  frameStart = cycle;
+  emulatedCycle.store(cycle, std::memory_order_release);
+}
+
+void Beeper::Render(int16_t *samples, unsigned int count) {
+  double cyclesPerSample = double(cyclesPerSecond) / sampleRate;
+  double newest = emulatedCycle.load(std::memory_order_acquire);
+
+  // Catch up after a stall or when the emulation runs ahead
+  double maxLag = MAX_LAG_FRAMES * cyclesPerSecond / 60.0;
+  if (playCycle < newest - maxLag) {
+    playCycle = newest - maxLag;
+  }
+
+  uint32_t step = uint32_t((uint64_t(TONE_HZ) << 32) / sampleRate);
+  for (unsigned int i = 0; i < count; ++i) {
+    // Hold at the newest reported cycle rather than guess what comes next
+    if (playCycle < newest) {
+      playCycle += cyclesPerSample;
+    }
+
+    const Transition *next;
+    while ((next = transitions.Peek()) && next->cycle <= playCycle) {
+      tone = next->on;
+      transitions.Pop();
+    }
+
+    if (tone) {
+      phase += step;
+      samples[i] = (phase & 0x80000000u) ? AMPLITUDE : -AMPLITUDE;
+    } else {
+      samples[i] = 0;
+    }
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "spsc_ring.h"
+#include <atomic>
+#include <cstdint>
+
+// Square wave beeper driven by the sound timer. The emulation thread reports
+// the tone state after every frame; changes travel to the audio thread as
+// transitions timestamped in emulated cycles through a lock-free ring, and
+// the audio callback synthesises them with their spacing intact.
+//
+// Playback follows the emulation as closely as it can: it never runs past
+// the last cycle the emulation reported (it holds the current tone instead),
+// and when it lags by more than two frames it skips ahead. So latency is
+// the audio buffer plus at most one callback, and neither the emulation
+// running ahead nor falling behind starves the device.
+class Beeper {
+public:
+  // 'cyclesPerSecond' converts cycle timestamps to time: instructions per
+  // frame times 60
+  explicit Beeper(unsigned int cyclesPerSecond)
+      : cyclesPerSecond(cyclesPerSecond) {}
+
+  // Emulation thread: call after every frame with the number of cycles run so
+  // far and whether the sound timer is running
+  void Update(uint64_t cycle, bool on);
+
+  // Audio thread, before the device starts
+  void SetSampleRate(unsigned int rate) { sampleRate = rate; }
+
+  // Audio thread: fill 'count' mono samples. No locks, no allocation.
+  void Render(int16_t *samples, unsigned int count);
+
+private:
+  struct Transition {
+    uint64_t cycle;
+    bool on;
+  };
+
+  unsigned int cyclesPerSecond;
+  SpscRing<Transition, 256> transitions;
+  std::atomic<uint64_t> emulatedCycle{0};
+
+  // Emulation thread only
+  uint64_t frameStart{};
+  bool sent = false;
+
+  // Audio thread only
+  unsigned int sampleRate = 48000;
+  double playCycle{};
+  bool tone = false;
+  uint32_t phase{}; // of the square wave, in 1/2^32 cycles
+};
@@ -0,0 +1,385 @@
+#include "chip8.h"
+#include "chip8_env.h"
+#include "chip8_pool.h"
+#include "framebuffer.h"
+#include "movie.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef CHIP8_ROM_DIR
+#define CHIP8_ROM_DIR "chip8-roms"
+#endif
+
+namespace {
+
+struct EngineName {
+  const char *name;
+  Engine engine;
+};
+
+const EngineName engineNames[] = {
+    {"table", Engine::Table},
+    {"switch", Engine::Switch},
+    {"threaded", Engine::Threaded},
+    {"jit", Engine::Jit},
+};
+
+// Benchmarks that run a program start every repeat with a fresh machine
+typedef std::shared_ptr<std::unique_ptr<Chip8>> Machine;
+
+// One benchmark: 'run' performs 'operations' operations (instructions or
+// frames) and is timed 'repeats' times. Runs that can do less than that,
+// because idle frames are skipped, set 'executed' to count what the last run
+// actually did and 'idleFrames' to how many frames it skipped.
+struct Benchmark {
+  std::string name;
+  const char *unit;
+  uint64_t operations;
+  std::function<void()> setup; // untimed, before every repeat
+  std::function<void()> run;
+  std::function<uint64_t()> executed;
+  std::function<uint64_t()> idleFrames;
+};
+
+struct Result {
+  double mean; // ns per operation
+  double stddev;
+  double min;
+  uint64_t operations; // performed by the last repeat
+  uint64_t idleFrames;
+};
+
+Result Measure(const Benchmark &benchmark, unsigned int repeats) {
+  std::vector<double> samples;
+  uint64_t operations = 0;
+  for (unsigned int i = 0; i < repeats; ++i) {
+    benchmark.setup();
+    auto start = std::chrono::steady_clock::now();
+    benchmark.run();
+    auto end = std::chrono::steady_clock::now();
+    operations =
+        benchmark.executed ? benchmark.executed() : benchmark.operations;
+    samples.push_back(std::chrono::duration<double, std::nano>(end - start)
+                          .count() /
+                      std::max<uint64_t>(operations, 1));
+  }
+
+  Result result{0, 0, samples[0], operations,
+                benchmark.idleFrames ? benchmark.idleFrames() : 0};
+  for (double sample : samples) {
+    result.mean += sample / samples.size();
+    result.min = std::min(result.min, sample);
+  }
+  for (double sample : samples) {
+    result.stddev += (sample - result.mean) * (sample - result.mean);
+  }
+  result.stddev = std::sqrt(result.stddev / samples.size());
+  return result;
+}
+
+// A program that runs 'prologue' once, then 'copies' copies of 'body' in a
+// loop
+std::vector<uint8_t> LoopProgram(const std::vector<uint16_t> &prologue,
+                                 const std::vector<uint16_t> &body,
+                                 unsigned int copies) {
+  std::vector<uint16_t> program = prologue;
+  uint16_t loop = START_ADDRESS + 2 * prologue.size();
+  for (unsigned int i = 0; i < copies; ++i) {
+    program.insert(program.end(), body.begin(), body.end());
+  }
+  program.push_back(0x1000 | loop);
+
+  std::vector<uint8_t> bytes;
+  for (uint16_t opcode : program) {
+    bytes.push_back(opcode >> 8);
+    bytes.push_back(opcode & 0xFF);
+  }
+  return bytes;
+}
+
+// Times Cycle() over a loop of one instruction class. Each Cycle() goes
+// through Run(1), so this is the per-instruction dispatch cost a frontend
+// calling Cycle() pays.
+Benchmark CycleBenchmark(const std::string &name,
+                         const std::vector<uint16_t> &prologue,
+                         const std::vector<uint16_t> &body,
+                         uint64_t instructions) {
+  std::vector<uint8_t> rom = LoopProgram(prologue, body, 64);
+  Machine machine = std::make_shared<std::unique_ptr<Chip8>>();
+  return Benchmark{name, "instruction", instructions,
+                   [machine, rom] {
+                     machine->reset(new Chip8);
+                     (*machine)->LoadROM(rom.data(), rom.size());
+                     (*machine)->Seed(1);
+                   },
+                   [machine, instructions] {
+                     Chip8 &chip8 = **machine;
+                     for (uint64_t i = 0; i < instructions; ++i) {
+                       chip8.Cycle();
+                     }
+                   }};
+}
+
+// Times a loop of Dxyn sprites drawn from the font at (x, y), in SUPER-CHIP
+// high resolution if 'hires'
+Benchmark DrawBenchmark(const std::string &name, bool hires, uint8_t x,
+                        uint8_t y, uint8_t height, uint64_t instructions) {
+  std::vector<uint16_t> prologue = {uint16_t(0x6000 | x), uint16_t(0x6100 | y),
+                                    uint16_t(0xA000 | FONTSET_START_ADDRESS)};
+  if (hires) {
+    prologue.insert(prologue.begin(), 0x00FF);
+  }
+  return CycleBenchmark(name, prologue, {uint16_t(0xD010 | height)},
+                        instructions);
+}
+
+// Times RunFrames() on a bundled ROM with one engine, as chip8-headless
+// does, per instruction executed
+Benchmark RomBenchmark(const std::string &romDir, const char *romName,
+                       const EngineName &engine, uint64_t instructions) {
+  std::vector<uint8_t> rom;
+  if (!ReadFile((romDir + "/" + romName).c_str(), rom)) {
+    std::exit(EXIT_FAILURE);
+  }
+  Machine machine = std::make_shared<std::unique_ptr<Chip8>>();
+  Engine e = engine.engine;
+  unsigned int frames = instructions / DEFAULT_INSTRUCTIONS_PER_FRAME;
+  return Benchmark{std::string("macro/") + romName + "/" + engine.name,
+                   "instruction",
+                   uint64_t(frames) * DEFAULT_INSTRUCTIONS_PER_FRAME,
+                   [machine, rom, e] {
+                     machine->reset(new Chip8);
+                     (*machine)->LoadROM(rom.data(), rom.size());
+                     (*machine)->Seed(1);
+                     (*machine)->SetEngine(e);
+                   },
+                   [machine, frames] { (*machine)->RunFrames(frames); },
+                   [machine] { return (*machine)->InstructionsExecuted(); },
+                   [machine] { return (*machine)->IdleFrames(); }};
+}
+
+// Forks a machine part way through a bundled ROM and runs the fork for a
+// frame, as a tree search expanding one node does. Forks come from new
+// machines or from a pool.
+Benchmark ForkBenchmark(const std::string &romDir, const char *romName,
+                        bool pooled, uint64_t forks) {
+  std::vector<uint8_t> rom;
+  if (!ReadFile((romDir + "/" + romName).c_str(), rom)) {
+    std::exit(EXIT_FAILURE);
+  }
+  std::shared_ptr<Chip8> parent = std::make_shared<Chip8>();
+  parent->LoadROM(rom.data(), rom.size());
+  parent->Seed(1);
+  parent->RunFrames(600);
+  std::shared_ptr<Chip8Pool> pool = std::make_shared<Chip8Pool>();
+  return Benchmark{std::string("fork/") + romName +
+                       (pooled ? "/pool" : "/new"),
+                   "fork", forks, [] {},
+                   [parent, pool, pooled, forks] {
+                     for (uint64_t i = 0; i < forks; ++i) {
+                       if (pooled) {
+                         pool->Fork(*parent, ForkRng::Split, i)->RunFrames(1);
+                       } else {
+                         parent->Fork(ForkRng::Split, i)->RunFrames(1);
+                       }
+                     }
+                   }};
+}
+
+// Steps a batch of environments through the C API with random actions,
+// per environment step
+Benchmark EnvBenchmark(const std::string &romDir, const char *romName,
+                       unsigned int count, unsigned int threads,
+                       uint64_t steps) {
+  std::vector<uint8_t> rom;
+  if (!ReadFile((romDir + "/" + romName).c_str(), rom)) {
+    std::exit(EXIT_FAILURE);
+  }
+  chip8_env_config config{};
+  config.threads = threads;
+  config.max_episode_frames = 3600;
+  config.seed = 1;
+  std::shared_ptr<chip8_env> env(
+      chip8_env_create(rom.data(), rom.size(), count, &config),
+      chip8_env_destroy);
+  if (!env) {
+    std::exit(EXIT_FAILURE);
+  }
+  std::shared_ptr<std::vector<uint64_t>> observations =
+      std::make_shared<std::vector<uint64_t>>(count *
+                                              CHIP8_ENV_OBSERVATION_WORDS);
+  std::shared_ptr<std::vector<uint16_t>> actions =
+      std::make_shared<std::vector<uint16_t>>(count);
+  std::shared_ptr<std::vector<uint8_t>> dones =
+      std::make_shared<std::vector<uint8_t>>(count);
+  uint64_t batches = std::max<uint64_t>(1, steps / count);
+  return Benchmark{
+      std::string("env/") + romName + "/" + std::to_string(count) + "x" +
+          std::to_string(threads),
+      "step", batches * count,
+      [env, observations] { chip8_env_reset(env.get(), observations->data()); },
+      [env, observations, actions, dones, batches] {
+        uint32_t random = 1;
+        for (uint64_t batch = 0; batch < batches; ++batch) {
+          for (uint16_t &action : *actions) {
+            random = random * 1664525u + 1013904223u;
+            action = 1 << (random >> 28);
+          }
+          chip8_env_step(env.get(), actions->data(), observations->data(),
+                         dones->data());
+        }
+      }};
+}
+
+// Benchmarks that skip idle frames also report the budget they were given
+// and the frames skipped, and are marked when idle frames skipped most of the
+// budget: their timings then say little about the interpreter
+void PrintJson(const Benchmark &benchmark, const Result &result,
+               unsigned int repeats, bool last) {
+  std::printf("    {\"name\": \"%s\", \"unit\": \"%s\", \"operations\": %llu, "
+              "\"repeats\": %u, \"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, "
+              "\"ns_per_op_stddev\": %.3f, \"ops_per_second\": %.0f",
+              benchmark.name.c_str(), benchmark.unit,
+              static_cast<unsigned long long>(result.operations), repeats,
+              result.mean, result.min, result.stddev,
+              result.mean > 0 ? 1e9 / result.mean : 0.0);
+  if (benchmark.idleFrames) {
+    bool mostlyIdle = result.operations * 2 < benchmark.operations;
+    std::printf(", \"budget\": %llu, \"idle_frames\": %llu, "
+                "\"mostly_idle\": %s",
+                static_cast<unsigned long long>(benchmark.operations),
+                static_cast<unsigned long long>(result.idleFrames),
+                mostlyIdle ? "true" : "false");
+  }
+  std::printf("}%s\n", last ? "" : ",");
+}
+
+} // namespace
+
+// Micro- and macrobenchmarks of the core, printed as JSON so runs can be
+// compared across changes
+int main(int argc, char **argv) {
+  std::string romDir = CHIP8_ROM_DIR;
+  std::string filter;
+  unsigned int repeats = 5;
+  uint64_t scale = 1;
+
+  for (int arg = 1; arg < argc; ++arg) {
+    if (std::strncmp(argv[arg], "--roms=", 7) == 0) {
+      romDir = argv[arg] + 7;
+    } else if (std::strncmp(argv[arg], "--filter=", 9) == 0) {
+      filter = argv[arg] + 9;
+    } else if (std::strncmp(argv[arg], "--repeats=", 10) == 0) {
+      repeats = std::max(1ul, std::stoul(argv[arg] + 10));
+    } else if (std::strncmp(argv[arg], "--scale=", 8) == 0) {
+      scale = std::max(1ull, std::stoull(argv[arg] + 8));
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--roms=Dir] [--filter=Substring] [--repeats=N]"
+                   " [--scale=N]\n";
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  const uint64_t micro = 2000000 * scale;
+  const uint64_t macro = 20000000 * scale;
+
+  std::vector<Benchmark> benchmarks = {
+      CycleBenchmark("cycle/6xkk", {}, {0x6012}, micro),
+      CycleBenchmark("cycle/7xkk", {}, {0x7003}, micro),
+      CycleBenchmark("cycle/8xy4", {0x6105}, {0x8014}, micro),
+      CycleBenchmark("cycle/8xy6", {}, {0x7001, 0x8006}, micro),
+      CycleBenchmark("cycle/3xkk", {}, {0x7001, 0x3000}, micro),
+      CycleBenchmark("cycle/Annn", {}, {0xA123}, micro),
+      CycleBenchmark("cycle/Cxkk", {}, {0xC0FF}, micro),
+      CycleBenchmark("cycle/Fx1E", {0x6001}, {0xF01E}, micro),
+      CycleBenchmark("cycle/Fx33", {0xA400}, {0x7001, 0xF033}, micro),
+      CycleBenchmark("cycle/2nnn+00EE", {0x1206, 0x00EE, 0x00EE},
+                     {0x2202}, micro),
+      CycleBenchmark("cycle/00E0", {}, {0x00E0}, micro),
+      DrawBenchmark("draw/h1/aligned", false, 8, 8, 1, micro),
+      DrawBenchmark("draw/h5/aligned", false, 8, 8, 5, micro),
+      DrawBenchmark("draw/h5/unaligned", false, 3, 8, 5, micro),
+      DrawBenchmark("draw/h15/unaligned", false, 3, 8, 15, micro),
+      DrawBenchmark("draw/h5/wrap-x", false, 62, 8, 5, micro),
+      DrawBenchmark("draw/h15/wrap-y", false, 8, 28, 15, micro),
+      DrawBenchmark("draw/hires/h5/unaligned", true, 67, 8, 5, micro),
+      DrawBenchmark("draw/hires/h5/word-straddle", true, 60, 8, 5, micro),
+      DrawBenchmark("draw/hires/16x16", true, 67, 8, 0, micro),
+      DrawBenchmark("draw/hires/16x16/wrap", true, 124, 56, 0, micro),
+      CycleBenchmark("scroll/00C4", {}, {0x00C4}, micro),
+      CycleBenchmark("scroll/hires/00C4", {0x00FF}, {0x00C4}, micro),
+      CycleBenchmark("scroll/hires/00FB+00FC", {0x00FF}, {0x00FB, 0x00FC},
+                     micro),
+  };
+
+  // Expanding a full frame to pixels, as the SDL frontend presents it, in
+  // both resolutions
+  uint64_t rows[VIDEO_WORDS];
+  std::vector<uint32_t> pixels(HIRES_WIDTH * HIRES_HEIGHT);
+  const uint64_t frames = 20000 * scale;
+  for (unsigned int words : {VIDEO_HEIGHT, VIDEO_WORDS}) {
+    benchmarks.push_back(Benchmark{
+        words == VIDEO_WORDS ? "frame/expand/hires" : "frame/expand", "frame",
+        frames,
+        [&rows] {
+          for (unsigned int i = 0; i < VIDEO_WORDS; ++i) {
+            rows[i] = 0x0123456789ABCDEFull * (i + 1);
+          }
+        },
+        [&rows, &pixels, frames, words] {
+          for (uint64_t i = 0; i < frames; ++i) {
+            rows[i % words] ^= i;
+            ExpandRows(rows, words, pixels.data());
+          }
+        }});
+  }
+
+  for (const char *rom : {"tetris.ch8", "trip8.ch8", "test_opcode.ch8"}) {
+    for (const EngineName &engine : engineNames) {
+      benchmarks.push_back(RomBenchmark(romDir, rom, engine, macro));
+    }
+  }
+  for (bool pooled : {false, true}) {
+    benchmarks.push_back(
+        ForkBenchmark(romDir, "trip8.ch8", pooled, macro / 1000));
+  }
+  for (unsigned int threads : {1u, 4u}) {
+    benchmarks.push_back(
+        EnvBenchmark(romDir, "tetris.ch8", 256, threads, macro / 500));
+  }
+
+  std::vector<const Benchmark *> selected;
+  for (const Benchmark &benchmark : benchmarks) {
+    if (benchmark.name.find(filter) != std::string::npos) {
+      selected.push_back(&benchmark);
+    }
+  }
+
+  const char *defaultEngine = "";
+  for (const EngineName &e : engineNames) {
+    if (e.engine == CHIP8_DEFAULT_ENGINE) {
+      defaultEngine = e.name;
+    }
+  }
+
+  std::printf("{\n  \"default_engine\": \"%s\",\n  \"benchmarks\": [\n",
+              defaultEngine);
+  for (size_t i = 0; i < selected.size(); ++i) {
+    Result result = Measure(*selected[i], repeats);
+    PrintJson(*selected[i], result, repeats, i + 1 == selected.size());
+    std::fflush(stdout);
+  }
+  std::printf("  ]\n}\n");
+
+  return 0;
+}
@@ -1,17 +1,26 @@
 #include "chip8.h"
+#include "aot.h"
+#include "jit.h"
+#include <algorithm>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sys/types.h>
-
-// Chip8 start address is 0x200 for instructions from the ROM
-const unsigned int START_ADDRESS = 0x200;
-
-// Each character of the Chip8 fontset is a 5 byte sprite.
-// The memory 0x050-0x0A0 is reserved for the 16 built-in characters (0-F)
-const unsigned int FONTSET_SIZE = 80;
-const unsigned int FONTSET_START_ADDRESS = 0x50;
+#include <type_traits>
+#include <vector>
+
+#ifdef CHIP8_PROFILE
+#define PROFILE_INSTRUCTION(address, opcode) profile->Count(address, opcode)
+#define PROFILE_DRAW()                                                         \
+  ProfileTimer drawTimer(profile->drawNanoseconds, profile->draws)
+#else
+#define PROFILE_INSTRUCTION(address, opcode) ((void)0)
+#define PROFILE_DRAW() ((void)0)
+#endif
 
 uint8_t fontset[FONTSET_SIZE] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -32,131 +41,566 @@ uint8_t fontset[FONTSET_SIZE] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-Chip8::Chip8()
-    // Initialise the random number generator with the current time
-    : randGen(std::chrono::system_clock::now().time_since_epoch().count()) {
+uint8_t bigFontset[BIG_FONTSET_SIZE] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x18, 0x3C, 0x66, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+static_assert(std::is_trivially_copyable<Chip8State>::value,
+              "save states copy Chip8State as raw bytes");
+static_assert(offsetof(Chip8State, stack) + sizeof(Chip8State::stack) <= 64,
+              "the registers, pointers, timers and stack share a cache line");
+
+Chip8::Chip8() {
+  // Initialise the random number generator with the current time
+  Seed(std::chrono::system_clock::now().time_since_epoch().count());
+
   // Initialise program counter to the start address
   pc = START_ADDRESS;
 
+  // Nothing decoded yet
+  std::fill(std::begin(decodePages), std::end(decodePages), EmptyPage());
+
   // Load fonts into memory
   for (unsigned int i = 0; i < FONTSET_SIZE; ++i) {
     memory[FONTSET_START_ADDRESS + i] = fontset[i];
   }
+  for (unsigned int i = 0; i < BIG_FONTSET_SIZE; ++i) {
+    memory[BIG_FONTSET_START_ADDRESS + i] = bigFontset[i];
+  }
+
+  // The tables are shared, nothing to build per instance
+  dispatch = &GetDispatch<ModernQuirks>();
+}
+
+Chip8::~Chip8() { ClearDecodeCache(); }
+
+// The function pointer table and subtables. Entries not set by Build() are
+// unsupported opcodes and run OP_NULL, see Lookup().
+struct Chip8::Dispatch {
+  Handler table[0xF + 1];
+  Handler table0[0xFF + 1];
+  Handler table8[0xE + 1];
+  Handler tableE[0xE + 1];
+  Handler tableF[0x65 + 1];
+
+  template <typename Quirks> void Build();
+};
+
+template <typename Quirks> void Chip8::Dispatch::Build() {
+  Handler null = &Call<&Chip8::OP_NULL>;
+  std::fill(std::begin(table), std::end(table), null);
+  std::fill(std::begin(table0), std::end(table0), null);
+  std::fill(std::begin(table8), std::end(table8), null);
+  std::fill(std::begin(tableE), std::end(tableE), null);
+  std::fill(std::begin(tableF), std::end(tableF), null);
+
+  // Main table, which indexes on the first opcode digit. Digits 0, 8, E and F
+  // are resolved through the subtables by Lookup().
+  table[0x1] = &Call<&Chip8::OP_1nnn>;
+  table[0x2] = &Call<&Chip8::OP_2nnn>;
+  table[0x3] = &Call<&Chip8::OP_3xkk>;
+  table[0x4] = &Call<&Chip8::OP_4xkk>;
+  table[0x5] = &Call<&Chip8::OP_5xy0>;
+  table[0x6] = &Call<&Chip8::OP_6xkk>;
+  table[0x7] = &Call<&Chip8::OP_7xkk>;
+  table[0x9] = &Call<&Chip8::OP_9xy0>;
+  table[0xA] = &Call<&Chip8::OP_Annn>;
+  table[0xB] = &Call<&Chip8::OP_Bnnn<Quirks>>;
+  table[0xC] = &Call<&Chip8::OP_Cxkk>;
+  table[0xD] = &Call<&Chip8::OP_Dxyn<Quirks>>;
+
+  // Subtables which index on the remainder of the opcode. table0 indexes on
+  // the low byte of 00kk.
+  table0[0xE0] = &Call<&Chip8::OP_00E0>;
+  table0[0xEE] = &Call<&Chip8::OP_00EE>;
+  for (size_t i = 0xC0; i <= 0xCF; i++) {
+    table0[i] = &Call<&Chip8::OP_00Cn>;
+  }
+  table0[0xFB] = &Call<&Chip8::OP_00FB>;
+  table0[0xFC] = &Call<&Chip8::OP_00FC>;
+  table0[0xFE] = &Call<&Chip8::OP_00FE>;
+  table0[0xFF] = &Call<&Chip8::OP_00FF>;
+
+  table8[0x0] = &Call<&Chip8::OP_8xy0>;
+  table8[0x1] = &Call<&Chip8::OP_8xy1>;
+  table8[0x2] = &Call<&Chip8::OP_8xy2>;
+  table8[0x3] = &Call<&Chip8::OP_8xy3>;
+  table8[0x4] = &Call<&Chip8::OP_8xy4>;
+  table8[0x5] = &Call<&Chip8::OP_8xy5>;
+  table8[0x6] = &Call<&Chip8::OP_8xy6<Quirks>>;
+  table8[0x7] = &Call<&Chip8::OP_8xy7>;
+  table8[0xE] = &Call<&Chip8::OP_8xyE<Quirks>>;
+
+  tableE[0x1] = &Call<&Chip8::OP_ExA1>;
+  tableE[0xE] = &Call<&Chip8::OP_Ex9E>;
+
+  tableF[0x07] = &Call<&Chip8::OP_Fx07>;
+  tableF[0x0A] = &Call<&Chip8::OP_Fx0A>;
+  tableF[0x15] = &Call<&Chip8::OP_Fx15>;
+  tableF[0x18] = &Call<&Chip8::OP_Fx18>;
+  tableF[0x1E] = &Call<&Chip8::OP_Fx1E>;
+  tableF[0x29] = &Call<&Chip8::OP_Fx29>;
+  tableF[0x30] = &Call<&Chip8::OP_Fx30>;
+  tableF[0x33] = &Call<&Chip8::OP_Fx33>;
+  tableF[0x55] = &Call<&Chip8::OP_Fx55<Quirks>>;
+  tableF[0x65] = &Call<&Chip8::OP_Fx65<Quirks>>;
+}
+
+// Built on first use, once per profile for the whole process
+template <typename Quirks> const Chip8::Dispatch &Chip8::GetDispatch() {
+  struct Built : Dispatch {
+    Built() { Build<Quirks>(); }
+  };
+  static const Built dispatch;
+  return dispatch;
+}
+
+void Chip8::SetQuirks(QuirkProfile profile) {
+  quirks = profile;
+  switch (profile) {
+  case QuirkProfile::Modern:
+    dispatch = &GetDispatch<ModernQuirks>();
+    break;
+  case QuirkProfile::Vip:
+    dispatch = &GetDispatch<VipQuirks>();
+    break;
+  case QuirkProfile::Schip:
+    dispatch = &GetDispatch<SchipQuirks>();
+    break;
+  }
 
-  // Initialise distribution which we will use with the random number generator
-  // using randByte(randGen)
-  randByte = std::uniform_int_distribution<uint8_t>(0, 255U);
-
-  // Set up function pointer table and subtables.
-  // Set main table, which indexes on the first opcode digit.
-  table[0x0] = &Chip8::Table0;
-  table[0x1] = &Chip8::OP_1nnn;
-  table[0x2] = &Chip8::OP_2nnn;
-  table[0x3] = &Chip8::OP_3xkk;
-  table[0x4] = &Chip8::OP_4xkk;
-  table[0x5] = &Chip8::OP_5xy0;
-  table[0x6] = &Chip8::OP_6xkk;
-  table[0x7] = &Chip8::OP_7xkk;
-  table[0x8] = &Chip8::Table8;
-  table[0x9] = &Chip8::OP_9xy0;
-  table[0xA] = &Chip8::OP_Annn;
-  table[0xB] = &Chip8::OP_Bnnn;
-  table[0xC] = &Chip8::OP_Cxkk;
-  table[0xD] = &Chip8::OP_Dxyn;
-  table[0xE] = &Chip8::TableE;
-  table[0xF] = &Chip8::TableF;
-
-  // Set default pointer of subtables to OP_NULL.
-  for (size_t i = 0; i <= 0xE; i++) {
-    table0[i] = &Chip8::OP_NULL;
-    table8[i] = &Chip8::OP_NULL;
-    tableE[i] = &Chip8::OP_NULL;
-  }
-
-  // Set subtables which index on the remainder of the opcode.
-  table0[0x0] = &Chip8::OP_00E0;
-  table0[0xE] = &Chip8::OP_00EE;
-
-  table8[0x0] = &Chip8::OP_8xy0;
-  table8[0x1] = &Chip8::OP_8xy1;
-  table8[0x2] = &Chip8::OP_8xy2;
-  table8[0x3] = &Chip8::OP_8xy3;
-  table8[0x4] = &Chip8::OP_8xy4;
-  table8[0x5] = &Chip8::OP_8xy5;
-  table8[0x6] = &Chip8::OP_8xy6;
-  table8[0x7] = &Chip8::OP_8xy7;
-  table8[0xE] = &Chip8::OP_8xyE;
-
-  tableE[0x1] = &Chip8::OP_ExA1;
-  tableE[0xE] = &Chip8::OP_Ex9E;
-
-  for (size_t i = 0; i <= 0x65; i++) {
-    tableF[i] = &Chip8::OP_NULL;
-  }
-
-  tableF[0x07] = &Chip8::OP_Fx07;
-  tableF[0x0A] = &Chip8::OP_Fx0A;
-  tableF[0x15] = &Chip8::OP_Fx15;
-  tableF[0x18] = &Chip8::OP_Fx18;
-  tableF[0x1E] = &Chip8::OP_Fx1E;
-  tableF[0x29] = &Chip8::OP_Fx29;
-  tableF[0x33] = &Chip8::OP_Fx33;
-  tableF[0x55] = &Chip8::OP_Fx55;
-  tableF[0x65] = &Chip8::OP_Fx65;
-}
-
-void Chip8::LoadROM(char const *filename) {
+  // Cached handlers and translations may be of the previous profile
+  ClearDecodeCache();
+  if (jit) {
+    jit->Flush();
+  }
+}
+
+bool Chip8::LoadROM(char const *filename) {
   // Open the file as a stream of binary and move the file pointer to the end
   std::ifstream file(filename, std::ios::binary | std::ios::ate);
 
   if (file.is_open()) {
     // Get size of file and allocate a buffer to hold the contents
     std::streampos size = file.tellg();
-    char *buffer = new char[size];
+    if (size > static_cast<std::streampos>(sizeof(memory) - START_ADDRESS)) {
+      std::cerr << "ROM too large: " << size << " bytes\n";
+      return false;
+    }
+    std::vector<uint8_t> buffer(static_cast<size_t>(size));
 
     // Go back to the beginning of the file and fill the buffer with the file
     // contents
     file.seekg(0, std::ios::beg);
-    file.read(buffer, size);
+    file.read(reinterpret_cast<char *>(buffer.data()), size);
     file.close();
 
-    // Load the ROM contents (from the buffer) into the Chip8's memory, starting
-    // at 0x200
-    for (long i = 0; i < size; ++i) {
-      memory[START_ADDRESS + i] = buffer[i];
+    if (!LoadROM(buffer.data(), buffer.size())) {
+      return false;
     }
 
     std::cout << "ROM loaded, size: " << size << " bytes\n";
+    return true;
+  }
+
+  std::cerr << "Failed to open ROM: " << filename << "\n";
+  return false;
+}
+
+bool Chip8::LoadROM(const uint8_t *data, size_t size) {
+  if (size > sizeof(memory) - START_ADDRESS) {
+    std::cerr << "ROM too large: " << size << " bytes\n";
+    return false;
+  }
+
+  // Load the ROM contents into the Chip8's memory, starting at 0x200
+  std::memcpy(memory + START_ADDRESS, data, size);
+
+  // Drop anything decoded from the previous contents
+  ClearDecodeCache();
+  if (jit) {
+    jit->Flush();
+  }
+  CheckAotCode();
+  idle = IdleState::Running;
+  dirtyRows = ~0ull;
+  dirtyPages = ~0ull;
+  return true;
+}
+
+namespace {
+
+// Save state files: this header followed by the raw Chip8State. Bump
+// SAVE_VERSION whenever Chip8State changes.
+const char SAVE_MAGIC[4] = {'C', '8', 'S', 'T'};
+const uint32_t SAVE_VERSION = 3;
+
+struct SaveHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t size;
+};
+
+} // namespace
+
+void Chip8::SaveState(Chip8State &state) const { state = *this; }
+
+void Chip8::LoadState(const Chip8State &state) {
+  // Drop predecoded and translated code only where the program changes
+  bool memoryChanged = std::memcmp(memory, state.memory, sizeof(memory)) != 0;
+  if (memoryChanged) {
+    for (unsigned int i = 0; i < MEMORY_SIZE; ++i) {
+      if (memory[i] != state.memory[i]) {
+        InvalidateCode(i);
+      }
+    }
+  }
+
+  static_cast<Chip8State &>(*this) = state;
+
+  // Compiled blocks are checked against the new memory as a whole
+  if (memoryChanged && aot) {
+    CheckAotCode();
+  }
+
+  idle = IdleState::Running;
+  loop.frame = ~0ull;
+  dirtyRows = ~0ull;
+  dirtyPages = ~0ull;
+}
+
+void Chip8::ForkInto(Chip8 &child, ForkRng rng, uint32_t branch) const {
+  static_cast<Chip8State &>(child) = *this;
+  if (rng == ForkRng::Split) {
+    child.Seed(randState + branch * 0x632BE5ABu);
+  }
+
+  child.instructionsPerFrame = instructionsPerFrame;
+  child.engine = engine;
+  child.quirks = quirks;
+  child.dispatch = dispatch;
+  child.budget = 0;
+  child.dirtyRows = dirtyRows;
+  std::memcpy(child.takenVideo, takenVideo, sizeof(takenVideo));
+  child.takenHires = takenHires;
+  child.dirtyPages = dirtyPages;
+  child.idle = idle;
+  child.frameCount = frameCount;
+  child.idleFrames = idleFrames;
+  child.instructionsExecuted = instructionsExecuted;
+  child.sideEffects = sideEffects;
+  child.loop = loop;
+
+  for (unsigned int page = 0; page < MEMORY_PAGES; ++page) {
+    Retain(decodePages[page]);
+    Release(child.decodePages[page]);
+    child.decodePages[page] = decodePages[page];
+  }
+  child.cacheInvalidations = cacheInvalidations;
+  if (child.jit) {
+    child.jit->Flush(); // translated from whatever the child ran before
+  }
+  child.aot = aot;
+  std::memcpy(child.aotStale, aotStale, sizeof(aotStale));
+  child.aotStaleBytes = aotStaleBytes;
+}
+
+std::unique_ptr<Chip8> Chip8::Fork(ForkRng rng, uint32_t branch) const {
+  std::unique_ptr<Chip8> child(new Chip8);
+  ForkInto(*child, rng, branch);
+  return child;
+}
+
+bool Chip8::SaveState(char const *filename) const {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    std::cerr << "Failed to open save state: " << filename << "\n";
+    return false;
+  }
 
-    // Free the buffer
-    delete[] buffer;
+  SaveHeader header;
+  std::memcpy(header.magic, SAVE_MAGIC, sizeof(header.magic));
+  header.version = SAVE_VERSION;
+  header.size = sizeof(Chip8State);
+
+  const Chip8State &state = *this;
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(&state), sizeof(state));
+  if (!file) {
+    std::cerr << "Failed to write save state: " << filename << "\n";
+    return false;
   }
+  return true;
 }
 
-// Decode Opcode instruction using Function pointer table
+bool Chip8::LoadState(char const *filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Failed to open save state: " << filename << "\n";
+    return false;
+  }
+
+  SaveHeader header;
+  Chip8State state;
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!file || std::memcmp(header.magic, SAVE_MAGIC, sizeof(SAVE_MAGIC)) != 0 ||
+      header.version != SAVE_VERSION || header.size != sizeof(Chip8State)) {
+    std::cerr << "Not a compatible save state: " << filename << "\n";
+    return false;
+  }
+
+  file.read(reinterpret_cast<char *>(&state), sizeof(state));
+  if (!file) {
+    std::cerr << "Truncated save state: " << filename << "\n";
+    return false;
+  }
+
+  LoadState(state);
+  return true;
+}
+
+void Chip8::Seed(uint32_t seed) {
+  // Scramble so nearby seeds give unrelated sequences; zero is a fixed point
+  randState = (seed ^ 0x9E3779B9u) * 0x85EBCA6Bu;
+  if (randState == 0) {
+    randState = 1;
+  }
+}
+
+// xorshift32, small enough to live in the saved machine state
+uint8_t Chip8::RandomByte() {
+  uint32_t x = randState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  randState = x;
+  return x >> 24;
+}
+
+namespace {
+
+const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+uint64_t HashBytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
 
-void Chip8::Table0() { ((*this).*(table0[opcode & 0x000Fu]))(); }
+} // namespace
+
+uint64_t Chip8::StateHash() const {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  hash = HashBytes(hash, registers, sizeof(registers));
+  hash = HashBytes(hash, memory, sizeof(memory));
+  hash = HashBytes(hash, &index, sizeof(index));
+  hash = HashBytes(hash, &pc, sizeof(pc));
+  hash = HashBytes(hash, stack, sizeof(stack));
+  hash = HashBytes(hash, &sp, sizeof(sp));
+  hash = HashBytes(hash, &delayTimer, sizeof(delayTimer));
+  hash = HashBytes(hash, &soundTimer, sizeof(soundTimer));
+  hash = HashBytes(hash, &hires, sizeof(hires));
+  hash = HashBytes(hash, video, sizeof(video));
+  return hash;
+}
 
-void Chip8::Table8() { ((*this).*(table8[opcode & 0x000Fu]))(); }
+// Decode Opcode instruction using the dispatch tables
+Chip8::Handler Chip8::Lookup(uint16_t opcode) const {
+  uint8_t low = opcode & 0x00FFu;
+  uint8_t n = opcode & 0x000Fu;
+  const Dispatch &d = *dispatch;
+
+  switch ((opcode & 0xF000u) >> 12) {
+  case 0x0:
+    // 0nnn (machine code routines) is not supported
+    return (opcode & 0x0F00u) == 0 ? d.table0[low] : d.table[0x0];
+  case 0x8:
+    return n < sizeof(d.table8) / sizeof(d.table8[0]) ? d.table8[n]
+                                                      : d.table[0x8];
+  case 0xE:
+    return n < sizeof(d.tableE) / sizeof(d.tableE[0]) ? d.tableE[n]
+                                                      : d.table[0xE];
+  case 0xF:
+    return low < sizeof(d.tableF) / sizeof(d.tableF[0]) ? d.tableF[low]
+                                                        : d.table[0xF];
+  default:
+    return d.table[(opcode & 0xF000u) >> 12];
+  }
+}
 
-void Chip8::TableE() { ((*this).*(tableE[opcode & 0x000Fu]))(); }
+// Read the two bytes at 'address' and extract the operands
+inline void Chip8::Fetch(uint16_t address, Instruction &ins) const {
+  uint16_t opcode = (memory[address] << 8) |
+                    memory[(address + 1) & (MEMORY_SIZE - 1)];
+
+  ins.opcode = opcode;
+  ins.nnn = opcode & 0x0FFFu;
+  ins.x = (opcode & 0x0F00u) >> 8;
+  ins.y = (opcode & 0x00F0u) >> 4;
+  ins.kk = opcode & 0x00FFu;
+  ins.n = opcode & 0x000Fu;
+}
 
-void Chip8::TableF() { ((*this).*(tableF[opcode & 0x00FFu]))(); }
+Chip8::DecodePage *Chip8::EmptyPage() {
+  static DecodePage empty;
+  return &empty;
+}
+
+// Pages are freed with their last reference. The empty page is never
+// counted, so machines on different threads don't all write to it.
+void Chip8::Retain(DecodePage *page) {
+  if (page != EmptyPage()) {
+    page->references.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void Chip8::Release(DecodePage *page) {
+  if (page != EmptyPage() &&
+      page->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete page;
+  }
+}
+
+// A page of the predecode cache, made this machine's own first if it is the
+// empty page or shared with forks. Other holders keep the old copy, which
+// still matches their memory.
+Chip8::Instruction *Chip8::WritablePage(unsigned int page) {
+  DecodePage *&entries = decodePages[page];
+  if (entries == EmptyPage() ||
+      entries->references.load(std::memory_order_acquire) > 1) {
+    DecodePage *copy = new DecodePage;
+    std::memcpy(copy->entries, entries->entries, sizeof(copy->entries));
+    Release(entries);
+    entries = copy;
+  }
+  return entries->entries;
+}
+
+void Chip8::ClearDecodeCache() {
+  for (DecodePage *&page : decodePages) {
+    Release(page);
+    page = EmptyPage();
+  }
+}
+
+// Fill a predecode cache entry from the two bytes at 'address'
+const Chip8::Instruction &Chip8::Decode(uint16_t address) {
+  Instruction &ins =
+      WritablePage(address / MEMORY_PAGE_SIZE)[address % MEMORY_PAGE_SIZE];
+  Fetch(address, ins);
+  ins.handler = Lookup(ins.opcode);
+  return ins;
+}
+
+void Chip8::Predecode(uint16_t start, uint16_t end) {
+  for (unsigned int address = start; address < end && address < MEMORY_SIZE;
+       ++address) {
+    Decode(address);
+  }
+}
+
+// A write to 'address' changes the instructions starting at 'address' and at
+// the byte before it.
+void Chip8::InvalidateCode(uint16_t address) {
+  uint16_t before = (address - 1) & (MEMORY_SIZE - 1);
+  for (uint16_t at : {address, before}) {
+    unsigned int page = at / MEMORY_PAGE_SIZE;
+    if (decodePages[page]->entries[at % MEMORY_PAGE_SIZE].handler) {
+      WritablePage(page)[at % MEMORY_PAGE_SIZE].handler = nullptr;
+      ++cacheInvalidations;
+    }
+  }
+
+  if (jit) {
+    jit->Invalidate(address);
+  }
+  if (aot) {
+    CheckAotCode(address);
+  }
+}
+
+void Chip8::SetAotProgram(const AotProgram *program) {
+  aot = program;
+  CheckAotCode();
+}
+
+// Track whether the compiled byte at 'address' still matches memory
+void Chip8::CheckAotCode(uint16_t address) {
+  uint64_t bit = 1ull << (address % 64);
+  if (!(aot->covered[address / 64] & bit)) {
+    return;
+  }
+
+  bool stale = memory[address] != aot->rom[address - START_ADDRESS];
+  if (stale != ((aotStale[address / 64] & bit) != 0)) {
+    aotStale[address / 64] ^= bit;
+    aotStaleBytes += stale ? 1 : -1;
+  }
+}
+
+// Compare every compiled byte with memory, after memory was replaced
+void Chip8::CheckAotCode() {
+  std::memset(aotStale, 0, sizeof(aotStale));
+  aotStaleBytes = 0;
+  if (aot) {
+    for (unsigned int address = 0; address < MEMORY_SIZE; ++address) {
+      CheckAotCode(address);
+    }
+  }
+}
+
+// True when none of the block's bytes was overwritten
+bool Chip8::AotBlockCurrent(uint16_t address, unsigned int count) const {
+  for (unsigned int i = address; i < address + 2 * count; ++i) {
+    if (aotStale[i / 64] & (1ull << (i % 64))) {
+      return false;
+    }
+  }
+  return true;
+}
 
 // Chip8 Cycle
-void Chip8::Cycle() {
-  // Fetch next instruction
-  opcode = (memory[pc] << 8) | memory[pc + 1];
+inline void Chip8::Step() {
+  // Fetch the next instruction from the predecode cache, decoding it the first
+  // time it is executed. Copied out, since the handler may replace a shared
+  // page, which another thread's fork could then free.
+  uint16_t address = pc & (MEMORY_SIZE - 1);
+  Instruction ins =
+      decodePages[address / MEMORY_PAGE_SIZE]->entries[address %
+                                                       MEMORY_PAGE_SIZE];
+  if (!ins.handler) {
+    ins = Decode(address);
+  }
+  PROFILE_INSTRUCTION(address, ins.opcode);
 
   // Increment PC before we execute
   pc += 2;
 
-  // Decode the instruction to determine what operation needs to occur
-  uint8_t opcodeIndex1 = (opcode & 0xF000u) >> 12;
-
-  // Find the corresponding table and then execute.
-  ((*this).*(table[opcodeIndex1]))();
+  // Execute the resolved handler
+  ins.handler(*this, ins);
+}
 
+// The timers count down at 60 Hz, once per frame, independent of how many
+// instructions run in that frame.
+void Chip8::TickTimers() {
   // Decrement delay timer
   if (delayTimer > 0) {
     --delayTimer;
@@ -168,35 +612,551 @@ void Chip8::Cycle() {
   }
 }
 
+void Chip8::Cycle() { Run(1); }
+
+// Run a batch of instructions without returning to the caller in between.
+// The timers are not touched, see RunFrames(). Stops early when the program
+// is found to be idle (see Idle()).
+void Chip8::Run(uint64_t cycles) {
+  budget = cycles;
+  instructionsExecuted += cycles;
+  idle = IdleState::Running;
+
+  switch (engine) {
+  case Engine::Table:
+    while (budget > 0) {
+      --budget;
+      Step();
+    }
+    break;
+  case Engine::Switch:
+    switch (quirks) {
+    case QuirkProfile::Modern:
+      RunSwitch<ModernQuirks>();
+      break;
+    case QuirkProfile::Vip:
+      RunSwitch<VipQuirks>();
+      break;
+    case QuirkProfile::Schip:
+      RunSwitch<SchipQuirks>();
+      break;
+    }
+    break;
+  case Engine::Threaded:
+    switch (quirks) {
+    case QuirkProfile::Modern:
+      RunThreaded<ModernQuirks>();
+      break;
+    case QuirkProfile::Vip:
+      RunThreaded<VipQuirks>();
+      break;
+    case QuirkProfile::Schip:
+      RunThreaded<SchipQuirks>();
+      break;
+    }
+    break;
+  case Engine::Jit:
+    RunJit();
+    break;
+  case Engine::Aot:
+    RunAot();
+    break;
+  }
+}
+
+// Run translated blocks while they fit in the remaining budget, and interpret
+// the instructions the JIT leaves alone.
+void Chip8::RunJit() {
+  if (!jit) {
+    jit.reset(new Jit(*this));
+  }
+
+  if (!jit->Available()) {
+    while (budget > 0) {
+      --budget;
+      Step();
+    }
+    return;
+  }
+
+  while (budget > 0) {
+    const JitBlock *block = jit->Get(pc & (MEMORY_SIZE - 1));
+
+    if (block && block->count <= budget) {
+#ifdef CHIP8_PROFILE
+      // Blocks are straight-line code, every instruction in them runs
+      for (unsigned int i = 0; i < block->count; ++i) {
+        uint16_t address = (pc + 2 * i) & (MEMORY_SIZE - 1);
+        PROFILE_INSTRUCTION(address, (memory[address] << 8) |
+                                         memory[(address + 1) &
+                                                (MEMORY_SIZE - 1)]);
+      }
+#endif
+      block->code(registers);
+      budget -= block->count;
+
+      // The block ended with a backward 1nnn, do what OP_1nnn would have done
+      if (block->loopCheck) {
+        CheckIdleLoop(block->loopJump);
+      }
+    } else {
+      --budget;
+      Step();
+    }
+  }
+}
+
+// Like RunJit(), with the blocks compiled into the binary by chip8-aot. Code
+// the compiler did not discover, Bnnn and overwritten blocks are interpreted.
+void Chip8::RunAot() {
+  // Blocks compiled for other quirks would behave differently
+  const AotBlock *blocks =
+      aot && aot->quirks == quirks ? aot->blocks : nullptr;
+
+  while (budget > 0) {
+    uint16_t address = pc & (MEMORY_SIZE - 1);
+    const AotBlock *block = blocks ? &blocks[address] : nullptr;
+
+    if (block && block->code && block->count <= budget &&
+        (aotStaleBytes == 0 || AotBlockCurrent(address, block->count))) {
+#ifdef CHIP8_PROFILE
+      for (unsigned int i = 0; i < block->count; ++i) {
+        uint16_t at = (address + 2 * i) & (MEMORY_SIZE - 1);
+        PROFILE_INSTRUCTION(at, (memory[at] << 8) |
+                                    memory[(at + 1) & (MEMORY_SIZE - 1)]);
+      }
+#endif
+      block->code(*this);
+      budget -= block->count;
+
+      if (block->loopCheck) {
+        CheckIdleLoop(block->loopJump);
+      }
+    } else {
+      --budget;
+      Step();
+    }
+  }
+}
+
+// Run whole 60 Hz frames: a fixed number of instructions, then one timer
+// tick. Frames spent waiting in Fx0A with no key down execute nothing.
+void Chip8::RunFrames(unsigned int frames) {
+  for (unsigned int i = 0; i < frames; ++i) {
+    if (idle != IdleState::UntilKey || AnyKeyDown()) {
+      Run(instructionsPerFrame);
+    }
+    if (idle != IdleState::Running) {
+      ++idleFrames;
+    }
+    TickTimers();
+    ++frameCount;
+  }
+}
+
+uint64_t Chip8::TakeDirtyRows() {
+  unsigned int words = RowWords();
+
+  // After a resolution change every row is new to the consumer
+  if (hires != takenHires) {
+    takenHires = hires;
+    std::memcpy(takenVideo, video, sizeof(video));
+    dirtyRows = 0;
+    return AllRows();
+  }
+
+  uint64_t rows = dirtyRows;
+  for (uint64_t pending = rows; pending != 0; pending &= pending - 1) {
+    unsigned int y = __builtin_ctzll(pending);
+    const uint64_t *row = video + y * words;
+    uint64_t *taken = takenVideo + y * words;
+    if (std::memcmp(row, taken, words * sizeof(*row)) == 0) {
+      rows &= ~(1ull << y);
+    } else {
+      std::memcpy(taken, row, words * sizeof(*row));
+    }
+  }
+
+  dirtyRows = 0;
+  return rows;
+}
+
+bool Chip8::AnyKeyDown() const {
+  for (unsigned int i = 0; i < KEY_COUNT; ++i) {
+    if (keypad[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Called after every backward 1nnn at 'jump'. If nothing but pc has changed
+// since the previous pass through the same jump in this frame, the program is
+// in a loop that cannot make progress until the keypad or the timers change,
+// both of which only happen between frames. Stop executing for this frame.
+void Chip8::CheckIdleLoop(uint16_t jump) {
+  if (loop.frame == frameCount && loop.jump == jump &&
+      loop.sideEffects == sideEffects && loop.index == index &&
+      loop.sp == sp && loop.delayTimer == delayTimer &&
+      loop.soundTimer == soundTimer &&
+      std::memcmp(loop.registers, registers, sizeof(registers)) == 0) {
+    idle = IdleState::UntilFrame;
+    SkipBudget();
+    return;
+  }
+
+  loop.frame = frameCount;
+  loop.jump = jump;
+  loop.sideEffects = sideEffects;
+  loop.index = index;
+  loop.sp = sp;
+  loop.delayTimer = delayTimer;
+  loop.soundTimer = soundTimer;
+  std::memcpy(loop.registers, registers, sizeof(registers));
+}
+
+// Switch dispatch: one switch over the opcode with direct (inlinable) calls
+// to the handlers, no function pointers and no predecode cache.
+template <typename Quirks>
+inline void Chip8::Execute(const Instruction &ins) {
+  switch (ins.opcode >> 12) {
+  case 0x0:
+    switch (ins.opcode) {
+    case 0x00E0:
+      OP_00E0(ins);
+      break;
+    case 0x00EE:
+      OP_00EE(ins);
+      break;
+    case 0x00FB:
+      OP_00FB(ins);
+      break;
+    case 0x00FC:
+      OP_00FC(ins);
+      break;
+    case 0x00FE:
+      OP_00FE(ins);
+      break;
+    case 0x00FF:
+      OP_00FF(ins);
+      break;
+    default:
+      if ((ins.opcode & 0xFFF0u) == 0x00C0) {
+        OP_00Cn(ins);
+      }
+      break;
+    }
+    break;
+  case 0x1:
+    OP_1nnn(ins);
+    break;
+  case 0x2:
+    OP_2nnn(ins);
+    break;
+  case 0x3:
+    OP_3xkk(ins);
+    break;
+  case 0x4:
+    OP_4xkk(ins);
+    break;
+  case 0x5:
+    OP_5xy0(ins);
+    break;
+  case 0x6:
+    OP_6xkk(ins);
+    break;
+  case 0x7:
+    OP_7xkk(ins);
+    break;
+  case 0x8:
+    switch (ins.n) {
+    case 0x0:
+      OP_8xy0(ins);
+      break;
+    case 0x1:
+      OP_8xy1(ins);
+      break;
+    case 0x2:
+      OP_8xy2(ins);
+      break;
+    case 0x3:
+      OP_8xy3(ins);
+      break;
+    case 0x4:
+      OP_8xy4(ins);
+      break;
+    case 0x5:
+      OP_8xy5(ins);
+      break;
+    case 0x6:
+      OP_8xy6<Quirks>(ins);
+      break;
+    case 0x7:
+      OP_8xy7(ins);
+      break;
+    case 0xE:
+      OP_8xyE<Quirks>(ins);
+      break;
+    }
+    break;
+  case 0x9:
+    OP_9xy0(ins);
+    break;
+  case 0xA:
+    OP_Annn(ins);
+    break;
+  case 0xB:
+    OP_Bnnn<Quirks>(ins);
+    break;
+  case 0xC:
+    OP_Cxkk(ins);
+    break;
+  case 0xD:
+    OP_Dxyn<Quirks>(ins);
+    break;
+  case 0xE:
+    if (ins.n == 0xE) {
+      OP_Ex9E(ins);
+    } else if (ins.n == 0x1) {
+      OP_ExA1(ins);
+    }
+    break;
+  case 0xF:
+    switch (ins.kk) {
+    case 0x07:
+      OP_Fx07(ins);
+      break;
+    case 0x0A:
+      OP_Fx0A(ins);
+      break;
+    case 0x15:
+      OP_Fx15(ins);
+      break;
+    case 0x18:
+      OP_Fx18(ins);
+      break;
+    case 0x1E:
+      OP_Fx1E(ins);
+      break;
+    case 0x29:
+      OP_Fx29(ins);
+      break;
+    case 0x30:
+      OP_Fx30(ins);
+      break;
+    case 0x33:
+      OP_Fx33(ins);
+      break;
+    case 0x55:
+      OP_Fx55<Quirks>(ins);
+      break;
+    case 0x65:
+      OP_Fx65<Quirks>(ins);
+      break;
+    }
+    break;
+  }
+}
+
+template <typename Quirks> void Chip8::RunSwitch() {
+  Instruction ins;
+  while (budget > 0) {
+    --budget;
+    Fetch(pc & (MEMORY_SIZE - 1), ins);
+    PROFILE_INSTRUCTION(pc & (MEMORY_SIZE - 1), ins.opcode);
+    pc += 2;
+    Execute<Quirks>(ins);
+  }
+}
+
+// Threaded dispatch: every handler jumps straight to the handler of the next
+// instruction through a table of label addresses (GCC/Clang extension).
+template <typename Quirks> void Chip8::RunThreaded() {
+#if defined(__GNUC__)
+  static void *const labels[16] = {
+      &&op_0, &&op_1, &&op_2, &&op_3, &&op_4, &&op_5, &&op_6, &&op_7,
+      &&op_8, &&op_9, &&op_A, &&op_B, &&op_C, &&op_D, &&op_E, &&op_F};
+
+  Instruction ins;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (budget == 0) {                                                         \
+      return;                                                                  \
+    }                                                                          \
+    --budget;                                                                  \
+    Fetch(pc & (MEMORY_SIZE - 1), ins);                                        \
+    PROFILE_INSTRUCTION(pc & (MEMORY_SIZE - 1), ins.opcode);                   \
+    pc += 2;                                                                   \
+    goto *labels[ins.opcode >> 12];                                            \
+  } while (0)
+
+  DISPATCH();
+
+op_0:
+  Execute<Quirks>(ins);
+  DISPATCH();
+op_1:
+  OP_1nnn(ins);
+  DISPATCH();
+op_2:
+  OP_2nnn(ins);
+  DISPATCH();
+op_3:
+  OP_3xkk(ins);
+  DISPATCH();
+op_4:
+  OP_4xkk(ins);
+  DISPATCH();
+op_5:
+  OP_5xy0(ins);
+  DISPATCH();
+op_6:
+  OP_6xkk(ins);
+  DISPATCH();
+op_7:
+  OP_7xkk(ins);
+  DISPATCH();
+op_8:
+  Execute<Quirks>(ins);
+  DISPATCH();
+op_9:
+  OP_9xy0(ins);
+  DISPATCH();
+op_A:
+  OP_Annn(ins);
+  DISPATCH();
+op_B:
+  OP_Bnnn<Quirks>(ins);
+  DISPATCH();
+op_C:
+  OP_Cxkk(ins);
+  DISPATCH();
+op_D:
+  OP_Dxyn<Quirks>(ins);
+  DISPATCH();
+op_E:
+  Execute<Quirks>(ins);
+  DISPATCH();
+op_F:
+  Execute<Quirks>(ins);
+  DISPATCH();
+
+#undef DISPATCH
+#else
+  RunSwitch<Quirks>();
+#endif
+}
+
 // Chip8 instructions
 
+// Rotate a 64-bit row right, moving pixels that fall off the right edge back
+// in on the left.
+static inline uint64_t RotateRight(uint64_t value, unsigned int shift) {
+  return (value >> shift) | (value << ((64 - shift) & 63));
+}
+
 // CLS: Clear the display
-void Chip8::OP_00E0() {
-  for (int y = 0; y < 32; ++y) {
-    for (int x = 0; x < 64; ++x) {
-      video[y * 64 + x] = 0;
+void Chip8::OP_00E0(const Instruction &ins) {
+  ++sideEffects;
+  unsigned int words = RowWords();
+  for (unsigned int y = 0; y < Height(); ++y) {
+    // Only rows that had something on them change
+    uint64_t any = 0;
+    for (unsigned int w = 0; w < words; ++w) {
+      any |= video[y * words + w];
+      video[y * words + w] = 0;
     }
+    dirtyRows |= static_cast<uint64_t>(any != 0) << y;
   }
 }
 
 // RET: Return from a subroutine
-void Chip8::OP_00EE() {
+void Chip8::OP_00EE(const Instruction &ins) {
   // Decrement SP
   --sp;
   // Set PC to top of stack
   pc = stack[sp];
 }
 
+// SCD nibble: Scroll the display down n rows. Whole rows are moved; the
+// rows scrolled in at the top are blank.
+void Chip8::OP_00Cn(const Instruction &ins) {
+  unsigned int n = ins.n;
+  unsigned int words = RowWords();
+  ++sideEffects;
+
+  std::memmove(video + n * words, video,
+               (Height() - n) * words * sizeof(*video));
+  std::memset(video, 0, n * words * sizeof(*video));
+  dirtyRows |= AllRows();
+}
+
+// SCR: Scroll the display right 4 pixels. Pixels shifted off the right edge
+// are lost.
+void Chip8::OP_00FB(const Instruction &ins) {
+  ++sideEffects;
+  if (hires) {
+    for (unsigned int y = 0; y < HIRES_HEIGHT; ++y) {
+      uint64_t left = video[2 * y];
+      video[2 * y] = left >> 4;
+      video[2 * y + 1] = (video[2 * y + 1] >> 4) | (left << 60);
+    }
+  } else {
+    for (unsigned int y = 0; y < VIDEO_HEIGHT; ++y) {
+      video[y] >>= 4;
+    }
+  }
+  dirtyRows |= AllRows();
+}
+
+// SCL: Scroll the display left 4 pixels
+void Chip8::OP_00FC(const Instruction &ins) {
+  ++sideEffects;
+  if (hires) {
+    for (unsigned int y = 0; y < HIRES_HEIGHT; ++y) {
+      uint64_t right = video[2 * y + 1];
+      video[2 * y] = (video[2 * y] << 4) | (right >> 60);
+      video[2 * y + 1] = right << 4;
+    }
+  } else {
+    for (unsigned int y = 0; y < VIDEO_HEIGHT; ++y) {
+      video[y] <<= 4;
+    }
+  }
+  dirtyRows |= AllRows();
+}
+
+// LOW: Switch to 64x32
+void Chip8::OP_00FE(const Instruction &ins) { SetResolution(false); }
+
+// HIGH: Switch to 128x64
+void Chip8::OP_00FF(const Instruction &ins) { SetResolution(true); }
+
+// Both resolution switches clear the display, since the row layout changes
+void Chip8::SetResolution(bool high) {
+  ++sideEffects;
+  hires = high ? 1 : 0;
+  std::memset(video, 0, sizeof(video));
+  dirtyRows |= AllRows();
+}
+
 // JP addr: Jump to location nnn.
-void Chip8::OP_1nnn() {
+void Chip8::OP_1nnn(const Instruction &ins) {
   // Mask the opcode with 0x0FFFu to get the 'nnn' address (which is being
   // jumped to)
-  uint16_t address = opcode & 0x0FFFu;
+  uint16_t address = ins.nnn;
+  uint16_t jump = pc - 2;
   pc = address;
+
+  // A jump backwards closes a loop, check whether the loop is idle
+  if (address <= jump) {
+    CheckIdleLoop(jump);
+  }
 }
 
 // CALL addr: Call subroutine at nnn.
-void Chip8::OP_2nnn() {
+void Chip8::OP_2nnn(const Instruction &ins) {
   // Current PC should point to next instruction. This is because return should
   // give us the next instruction, not the same call instruction (that would
   // result in infinite loop).
@@ -206,17 +1166,17 @@ void Chip8::OP_2nnn() {
   // Increment SP
   ++sp;
 
-  uint16_t address = opcode & 0x0FFFu;
+  uint16_t address = ins.nnn;
   pc = address;
 }
 
 // SE Vx, byte: Skip next instruction if Vx = kk.
-void Chip8::OP_3xkk() {
+void Chip8::OP_3xkk(const Instruction &ins) {
   // Get the register index and the value at the index
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
   // Compare it with kk
-  uint8_t kk = opcode & 0x00FFu;
+  uint8_t kk = ins.kk;
   if (Vx == kk) {
     // Increment program counter by 2 bytes (each instruction is 2 bytes)
     pc += 2;
@@ -224,20 +1184,20 @@ void Chip8::OP_3xkk() {
 }
 
 // SNE Vx, byte: Skip next instruction if Vx != kk.
-void Chip8::OP_4xkk() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_4xkk(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
-  uint8_t kk = opcode & 0x00FFu;
+  uint8_t kk = ins.kk;
   if (Vx != kk) {
     pc += 2;
   }
 }
 
 // SE Vx, Vy: Skip next instruction if Vx = Vy.
-void Chip8::OP_5xy0() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_5xy0(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+  uint8_t y = ins.y;
   uint8_t Vy = registers[y];
   if (Vx == Vy) {
     pc += 2;
@@ -245,51 +1205,51 @@ void Chip8::OP_5xy0() {
 }
 
 // LD Vx, byte: Set Vx = kk.
-void Chip8::OP_6xkk() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t kk = opcode & 0x00FFu;
+void Chip8::OP_6xkk(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t kk = ins.kk;
   registers[x] = kk;
 }
 
 // ADD Vx, byte: Set Vx = Vx + kk.
-void Chip8::OP_7xkk() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t kk = opcode & 0x00FFu;
+void Chip8::OP_7xkk(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t kk = ins.kk;
   registers[x] += kk;
 }
 
 // LD Vx, Vy: Set Vx = Vy.
-void Chip8::OP_8xy0() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+void Chip8::OP_8xy0(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t y = ins.y;
   registers[x] = registers[y];
 }
 
 // OR Vx, Vy: Set Vx = Vx OR Vy.
-void Chip8::OP_8xy1() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+void Chip8::OP_8xy1(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t y = ins.y;
   registers[x] = registers[x] | registers[y];
 }
 
 // AND Vx, Vy: Set Vx = Vx AND Vy.
-void Chip8::OP_8xy2() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+void Chip8::OP_8xy2(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t y = ins.y;
   registers[x] = registers[x] & registers[y];
 }
 
 // XOR Vx, Vy: Set Vx = Vx XOR Vy.
-void Chip8::OP_8xy3() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+void Chip8::OP_8xy3(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t y = ins.y;
   registers[x] = registers[x] ^ registers[y];
 }
 
 // ADD Vx, Vy: Set Vx = Vx + Vy, set VF = carry.
-void Chip8::OP_8xy4() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+void Chip8::OP_8xy4(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t y = ins.y;
   uint16_t sum = registers[x] + registers[y];
   registers[x] = sum & 0x00FFu; // Mask to get the bottom 8 bits.
   sum = sum >> 8;
@@ -297,9 +1257,9 @@ void Chip8::OP_8xy4() {
 }
 
 // SUB Vx, Vy: Set Vx = Vx - Vy, set VF = NOT borrow.
-void Chip8::OP_8xy5() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+void Chip8::OP_8xy5(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t y = ins.y;
   if (registers[x] < registers[y]) {
     registers[15] = 0;
   } else {
@@ -310,19 +1270,20 @@ void Chip8::OP_8xy5() {
   registers[x] = registers[x] - registers[y];
 }
 
-// SHR Vx {, Vy}: Set Vx = Vx SHR 1.
-void Chip8::OP_8xy6() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  // Set VF to the least significant bit of Vx
-  registers[15] = registers[x] & 1;
-  // Divide Vx by 2 by bit-shifting right.
-  registers[x] = registers[x] >> 1;
+// SHR Vx {, Vy}: Set Vx = Vx SHR 1, or Vy SHR 1 with the shift quirk.
+template <typename Quirks> void Chip8::OP_8xy6(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t source = Quirks::shiftUsesVy ? ins.y : x;
+  // Set VF to the least significant bit of the source
+  registers[15] = registers[source] & 1;
+  // Divide by 2 by bit-shifting right.
+  registers[x] = registers[source] >> 1;
 }
 
 // SUBN Vx, Vy: Set Vx = Vy - Vx, set VF = NOT borrow.
-void Chip8::OP_8xy7() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+void Chip8::OP_8xy7(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t y = ins.y;
   if (registers[y] < registers[x]) {
     registers[15] = 0;
   } else {
@@ -331,18 +1292,19 @@ void Chip8::OP_8xy7() {
   registers[x] = registers[y] - registers[x];
 }
 
-// SHL Vx {, Vy}: Set Vx = Vx SHL 1.
-void Chip8::OP_8xyE() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  registers[15] = (registers[x] & 0x80u) >> 7;
-  registers[x] = registers[x] << 1;
+// SHL Vx {, Vy}: Set Vx = Vx SHL 1, or Vy SHL 1 with the shift quirk.
+template <typename Quirks> void Chip8::OP_8xyE(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t source = Quirks::shiftUsesVy ? ins.y : x;
+  registers[15] = (registers[source] & 0x80u) >> 7;
+  registers[x] = registers[source] << 1;
 }
 
 // SNE Vx, Vy: Skip next instruction if Vx != Vy.
-void Chip8::OP_9xy0() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_9xy0(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+  uint8_t y = ins.y;
   uint8_t Vy = registers[y];
   if (Vx != Vy) {
     pc += 2;
@@ -350,70 +1312,129 @@ void Chip8::OP_9xy0() {
 }
 
 // LD I, addr: Set I = nnn.
-void Chip8::OP_Annn() {
-  uint16_t nnn = opcode & 0x0FFFu;
+void Chip8::OP_Annn(const Instruction &ins) {
+  uint16_t nnn = ins.nnn;
   // 'I' refers to the index register.
   index = nnn;
 }
 
-// JP V0, addr: Jump to location nnn + V0.
-void Chip8::OP_Bnnn() {
-  uint16_t nnn = opcode & 0x0FFFu;
-  pc = nnn + registers[0];
+// JP V0, addr: Jump to location nnn + V0, or nnn + Vx with the jump quirk.
+template <typename Quirks> void Chip8::OP_Bnnn(const Instruction &ins) {
+  uint16_t nnn = ins.nnn;
+  pc = nnn + registers[Quirks::jumpUsesVx ? ins.x : 0];
 }
 
 // RND Vx, byte: Set Vx = random byte AND kk.
-void Chip8::OP_Cxkk() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
-  uint8_t rand = randByte(randGen);
-  uint8_t kk = opcode & 0x00FFu;
+void Chip8::OP_Cxkk(const Instruction &ins) {
+  ++sideEffects;
+  uint8_t x = ins.x;
+  uint8_t rand = RandomByte();
+  uint8_t kk = ins.kk;
   registers[x] = rand & kk;
 }
 
 // DRW Vx, Vy, nibble: Display n-byte sprite starting at memory location I at
-// (Vx, Vy), set VF = collision.
-void Chip8::OP_Dxyn() {
+// (Vx, Vy), set VF = collision. The position wraps around the screen; the
+// sprite wraps too, or is clipped at the edges with the clip quirk.
+template <typename Quirks> void Chip8::OP_Dxyn(const Instruction &ins) {
+  PROFILE_DRAW();
+
   // n is the height of the sprite in pixels.
   // The sprite is 8 pixels wide. This works since Chip8 sprites are always 8
   // pixels wide.
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
-  uint8_t y = (opcode & 0x00F0u) >> 4;
+  uint8_t y = ins.y;
   uint8_t Vy = registers[y];
-  uint8_t n = opcode & 0x000Fu;
+  uint8_t n = ins.n;
 
-  // Read 'n' bytes from 'index' and write them.
-  registers[15] = 0;
-  for (int i = 0; i < n; ++i) {
-    // Dont need to modulo when we read 'n' bytes from memory.
-    uint8_t spriteByte = memory[index + i];
+  ++sideEffects;
 
-    for (int j = 0; j < 8; ++j) {
-      // Wrapping in X and Y for the sprite.
-      uint8_t pixelX = (Vx + j) % 64;
-      uint8_t pixelY = (Vy + i) % 32;
+  if (hires) {
+    DrawHighRes<Quirks>(Vx % HIRES_WIDTH, Vy % HIRES_HEIGHT, n);
+    return;
+  }
 
-      uint32_t spritePixel = (spriteByte >> (7 - j)) & 1;
+  // Wrapping in X is a rotate of the whole row, wrapping in Y is done per row.
+  // Clipping shifts the pixels off the right edge out and stops at the bottom.
+  unsigned int shift = Vx % VIDEO_WIDTH;
+  unsigned int startY = Vy % VIDEO_HEIGHT;
+  if (Quirks::clipSprites && n > VIDEO_HEIGHT - startY) {
+    n = VIDEO_HEIGHT - startY;
+  }
 
-      uint32_t &oldPixel = video[pixelY * 64 + pixelX];
+  // Read 'n' bytes from 'index' and XOR them into the rows. A collision is
+  // any sprite bit landing on a pixel that is already set.
+  uint64_t collision = 0;
+  for (int i = 0; i < n; ++i) {
+    // I is 16 bits wide, keep the read inside memory
+    uint64_t sprite =
+        static_cast<uint64_t>(memory[(index + i) & (MEMORY_SIZE - 1)]) << 56;
+    uint64_t spriteRow =
+        Quirks::clipSprites ? sprite >> shift : RotateRight(sprite, shift);
+
+    unsigned int rowIndex = (startY + i) % VIDEO_HEIGHT;
+    uint64_t &row = video[rowIndex];
+    collision |= row & spriteRow;
+    row ^= spriteRow;
+
+    // An empty sprite row leaves the framebuffer row untouched
+    dirtyRows |= static_cast<uint64_t>(spriteRow != 0) << rowIndex;
+  }
 
-      // Check collision: if oldPixel is white (0xFFFFFFFF) and we're about to
-      // draw a "1"
-      if (spritePixel && (oldPixel == 0xFFFFFFFF)) {
-        registers[0xF] = 1;
-      }
+  registers[0xF] = collision ? 1 : 0;
+}
 
-      // Toggle: if it was white, turn it black; if black, turn it white
-      if (spritePixel) {
-        oldPixel = (oldPixel == 0xFFFFFFFF) ? 0xFF000000 : 0xFFFFFFFF;
-      }
+// Dxyn in high resolution, where a row is two words and n = 0 draws a 16x16
+// sprite (two bytes per row). Each sprite row is split into the part landing
+// in the word holding x and the part spilling into the next word (the first
+// one of the row when it wraps), with the same two shifts for every row.
+// Clipping drops that spill at the right edge and the rows past the bottom.
+template <typename Quirks>
+void Chip8::DrawHighRes(unsigned int x, unsigned int y, unsigned int height) {
+  bool wide = height == 0;
+  unsigned int bytes = wide ? 2 : 1;
+  if (wide) {
+    height = 16;
+  }
+  if (Quirks::clipSprites && height > HIRES_HEIGHT - y) {
+    height = HIRES_HEIGHT - y;
+  }
+
+  unsigned int shift = x % 64;
+  unsigned int first = x / 64;
+  unsigned int second = first ^ 1;
+  uint64_t tailMask = Quirks::clipSprites && first == 1 ? 0 : ~0ull;
+
+  uint64_t collision = 0;
+  for (unsigned int i = 0; i < height; ++i) {
+    uint16_t address = index + bytes * i;
+    uint64_t sprite = static_cast<uint64_t>(memory[address & (MEMORY_SIZE - 1)])
+                      << 56;
+    if (wide) {
+      sprite |= static_cast<uint64_t>(
+                    memory[(address + 1) & (MEMORY_SIZE - 1)])
+                << 48;
     }
+
+    // Two shifts so that shift == 0 spills nothing
+    uint64_t head = sprite >> shift;
+    uint64_t tail = ((sprite << (63 - shift)) << 1) & tailMask;
+
+    unsigned int rowIndex = (y + i) % HIRES_HEIGHT;
+    uint64_t *row = video + 2 * rowIndex;
+    collision |= (row[first] & head) | (row[second] & tail);
+    row[first] ^= head;
+    row[second] ^= tail;
+    dirtyRows |= static_cast<uint64_t>(sprite != 0) << rowIndex;
   }
+
+  registers[0xF] = collision ? 1 : 0;
 }
 
 // SKP Vx: Skip next instruction if key with the value of Vx is pressed.
-void Chip8::OP_Ex9E() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Ex9E(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
   if (keypad[Vx]) {
     pc += 2;
@@ -421,8 +1442,8 @@ void Chip8::OP_Ex9E() {
 }
 
 // SKNP Vx: Skip next instruction if key with the value of Vx is not pressed.
-void Chip8::OP_ExA1() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_ExA1(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
   if (!keypad[Vx]) {
     pc += 2;
@@ -430,14 +1451,14 @@ void Chip8::OP_ExA1() {
 }
 
 // LD Vx, DT: Set Vx = delay timer value.
-void Chip8::OP_Fx07() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Fx07(const Instruction &ins) {
+  uint8_t x = ins.x;
   registers[x] = delayTimer;
 }
 
 // LD Vx, K: Wait for a key press, store the value of the key in Vx.
-void Chip8::OP_Fx0A() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Fx0A(const Instruction &ins) {
+  uint8_t x = ins.x;
 
   // 'wait' by decrementing the PC by 2 whenever a keypad value is not detected.
   // This makes the same instruction run repeatedly (which has wait behaviour).
@@ -475,67 +1496,102 @@ void Chip8::OP_Fx0A() {
     registers[x] = 15;
   } else {
     pc -= 2;
+
+    // Nothing changes until a key goes down: stop for this frame, and skip
+    // whole frames until then (see RunFrames()).
+    idle = IdleState::UntilKey;
+    SkipBudget();
   }
 }
 
 // LD DT, Vx: Set delay timer = Vx.
-void Chip8::OP_Fx15() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Fx15(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
 
   delayTimer = Vx;
 }
 
 // LD ST, Vx: Set sound timer = Vx.
-void Chip8::OP_Fx18() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Fx18(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
 
   soundTimer = Vx;
 }
 
 // ADD I, Vx: Set I = I + Vx.
-void Chip8::OP_Fx1E() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Fx1E(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
 
   index = index + Vx;
 }
 
 // LD F, Vx: Set I = location of sprite for digit Vx.
-void Chip8::OP_Fx29() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Fx29(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
 
   index = Vx * 5 + FONTSET_START_ADDRESS;
 }
 
+// LD HF, Vx: Set I = location of the 8x10 sprite for digit Vx.
+void Chip8::OP_Fx30(const Instruction &ins) {
+  uint8_t x = ins.x;
+  uint8_t Vx = registers[x];
+
+  index = (Vx & 0xF) * 10 + BIG_FONTSET_START_ADDRESS;
+}
+
 // LD B, Vx: Store BCD representation of Vx in memory locations I, I+1, and I+2.
-void Chip8::OP_Fx33() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+void Chip8::OP_Fx33(const Instruction &ins) {
+  uint8_t x = ins.x;
   uint8_t Vx = registers[x];
-  memory[index] = Vx / 100;
-  memory[index + 1] = Vx / 10 % 10;
-  memory[index + 2] = Vx % 10;
+  ++sideEffects;
+
+  uint16_t address = index & (MEMORY_SIZE - 1);
+  memory[address] = Vx / 100;
+  memory[(address + 1) & (MEMORY_SIZE - 1)] = Vx / 10 % 10;
+  memory[(address + 2) & (MEMORY_SIZE - 1)] = Vx % 10;
+
+  for (int i = 0; i < 3; ++i) {
+    uint16_t written = (address + i) & (MEMORY_SIZE - 1);
+    dirtyPages |= 1ull << (written / MEMORY_PAGE_SIZE);
+    InvalidateCode(written);
+  }
 }
 
 // LD [I], Vx: Store registers V0 through Vx in memory starting at location I.
-void Chip8::OP_Fx55() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+template <typename Quirks> void Chip8::OP_Fx55(const Instruction &ins) {
+  uint8_t x = ins.x;
+
+  ++sideEffects;
 
   for (int i = 0; i <= x; ++i) {
-    memory[index + i] = registers[i];
+    uint16_t address = (index + i) & (MEMORY_SIZE - 1);
+    memory[address] = registers[i];
+    dirtyPages |= 1ull << (address / MEMORY_PAGE_SIZE);
+    InvalidateCode(address);
+  }
+
+  if (Quirks::loadStoreIncrementsIndex) {
+    index += x + 1;
   }
 }
 
 // LD Vx, [I]
-void Chip8::OP_Fx65() {
-  uint8_t x = (opcode & 0x0F00u) >> 8;
+template <typename Quirks> void Chip8::OP_Fx65(const Instruction &ins) {
+  uint8_t x = ins.x;
 
   for (int i = 0; i <= x; ++i) {
-    registers[i] = memory[index + i];
+    registers[i] = memory[(index + i) & (MEMORY_SIZE - 1)];
+  }
+
+  if (Quirks::loadStoreIncrementsIndex) {
+    index += x + 1;
   }
 }
 
 // Do nothing - Default function table function.
-void Chip8::OP_NULL() {}
\ No newline at end of file
+void Chip8::OP_NULL(const Instruction &ins) {}
\ No newline at end of file
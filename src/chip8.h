@@ -1,151 +1,471 @@
+#pragma once
+
+#include "profile.h"
+#include "quirks.h"
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <random>
+#include <memory>
 
 const unsigned int KEY_COUNT = 16;
 const unsigned int VIDEO_HEIGHT = 32;
 const unsigned int VIDEO_WIDTH = 64;
 
-class Chip8 {
-public:
-  Chip8();                            // Constructor
-  void LoadROM(char const *filename); // Load a ROM into memory
-  void Cycle();
-
-  uint8_t keypad[KEY_COUNT]{};
-  uint32_t video[VIDEO_WIDTH * VIDEO_HEIGHT]{};
-
-private:
-  // Chip8 class members - Components of Chip8
+// SUPER-CHIP high resolution mode (00FF, back to low with 00FE)
+const unsigned int HIRES_HEIGHT = 64;
+const unsigned int HIRES_WIDTH = 128;
+
+// The framebuffer is packed 64 pixels to a word, bit 63 leftmost, row after
+// row: one word per row in low resolution, two in high resolution
+const unsigned int VIDEO_WORDS = HIRES_WIDTH / 64 * HIRES_HEIGHT;
+
+const unsigned int MEMORY_SIZE = 4096;
+
+// Granularity of memory write tracking, one bit of a 64-bit mask per page
+const unsigned int MEMORY_PAGE_SIZE = MEMORY_SIZE / 64;
+const unsigned int MEMORY_PAGES = MEMORY_SIZE / MEMORY_PAGE_SIZE;
+
+// Chip8 start address is 0x200 for instructions from the ROM
+const unsigned int START_ADDRESS = 0x200;
+
+// Each character of the Chip8 fontset is a 5 byte sprite.
+// The memory 0x050-0x0A0 is reserved for the 16 built-in characters (0-F)
+const unsigned int FONTSET_SIZE = 80;
+const unsigned int FONTSET_START_ADDRESS = 0x50;
+
+// SUPER-CHIP 8x10 digits (0-F) for Fx30, right after the small ones
+const unsigned int BIG_FONTSET_SIZE = 160;
+const unsigned int BIG_FONTSET_START_ADDRESS = 0xA0;
+
+// Interpreter loops selectable at run time. Table dispatches predecoded
+// instructions through the function pointer tables, Switch decodes every
+// instruction with a single switch, and Threaded uses computed gotos where the
+// compiler supports them (it falls back to Switch otherwise). Jit runs
+// translated x86-64 blocks and interprets everything else. Aot does the same
+// with blocks compiled ahead of time by chip8-aot (see SetAotProgram()), and
+// runs like Table without them.
+enum class Engine { Table, Switch, Threaded, Jit, Aot };
+
+// What the program is doing, as seen by the last Run(). UntilFrame: it is
+// spinning in a loop that only the next timer tick or keypad change can
+// break, so the rest of the frame was skipped. UntilKey: it is waiting in
+// Fx0A and nothing will run until a key is pressed.
+enum class IdleState { Running, UntilFrame, UntilKey };
+
+// Where a fork's random numbers for Cxkk come from. Shared: it continues the
+// parent's stream, drawing exactly what the parent would have, so branches
+// differ only by their inputs. Split: a stream of its own, derived from the
+// parent's and a branch number, so branches are independent and a search
+// still runs the same way every time.
+enum class ForkRng { Shared, Split };
+
+class Jit;
+class Chip8Lanes;
+class Chip8Pool;
+struct AotProgram;
+
+#ifndef CHIP8_DEFAULT_ENGINE
+#define CHIP8_DEFAULT_ENGINE Engine::Table
+#endif
+
+// Number of instructions executed by RunFrames() for each 60 Hz frame.
+const unsigned int DEFAULT_INSTRUCTIONS_PER_FRAME = 10;
+
+// Everything that makes up the emulated machine, kept in one trivially
+// copyable block so a save state is a single copy. It starts every Chip8, so
+// the fields almost every instruction touches come first and share the
+// object's first cache line; memory and the framebuffer follow.
+struct Chip8State {
   uint8_t registers[16]{};
-  uint8_t memory[4096]{};
   uint16_t index{};
   uint16_t pc{};
-  uint16_t stack[16]{};
   uint8_t sp{};
   uint8_t delayTimer{};
   uint8_t soundTimer{};
-  uint16_t opcode;
+  uint8_t hires{};       // 1 in SUPER-CHIP high resolution mode
+  uint32_t randState{1}; // xorshift32 state for Cxkk, never zero
+  uint16_t stack[16]{};
+  uint8_t keypad[KEY_COUNT]{};
+  uint8_t memory[MEMORY_SIZE]{};
+  // One bit per pixel, see VIDEO_WORDS. Bit 63 is the leftmost pixel.
+  uint64_t video[VIDEO_WORDS]{};
+};
+
+class Chip8 : private Chip8State {
+public:
+  Chip8();                            // Constructor
+  ~Chip8();
+  bool LoadROM(char const *filename); // Load a ROM into memory
+  bool LoadROM(const uint8_t *data, size_t size); // ...from a buffer
+  void Cycle();                       // Execute one instruction
+
+  // Batch execution: loop internally instead of one Cycle() call per
+  // iteration of the caller's loop. Run() only executes instructions;
+  // RunFrames() runs instructionsPerFrame instructions and then ticks the
+  // timers once for each 60 Hz frame.
+  void Run(uint64_t cycles);
+  void RunFrames(unsigned int frames);
+  void TickTimers();
+
+  void SetInstructionsPerFrame(unsigned int instructions) {
+    instructionsPerFrame = instructions;
+  }
+  unsigned int InstructionsPerFrame() const { return instructionsPerFrame; }
+
+  // FNV-1a hash of the registers, memory, stack, timers and framebuffer. Two
+  // engines running the same ROM for the same budget must agree on it.
+  uint64_t StateHash() const;
+
+  // Reseed the random number generator used by Cxkk
+  void Seed(uint32_t seed);
+
+  // Save states. The in-memory forms are one copy of the machine state; the
+  // file form adds a versioned header and fails on a mismatched version or
+  // layout. Restoring retranslates only the code whose bytes changed.
+  void SaveState(Chip8State &state) const;
+  void LoadState(const Chip8State &state);
+  bool SaveState(char const *filename) const;
+  bool LoadState(char const *filename);
+
+  // Cheap copies of a running machine for tree search. The fork gets the
+  // machine state, settings and idle tracking, and shares the predecoded
+  // instructions until one side writes over code or decodes new code.
+  // ForkInto() reuses an existing machine, see Chip8Pool for recycling them.
+  // Translations are not shared: a fork of a Jit machine translates its code
+  // again.
+  void ForkInto(Chip8 &child, ForkRng rng = ForkRng::Shared,
+                uint32_t branch = 0) const;
+  std::unique_ptr<Chip8> Fork(ForkRng rng = ForkRng::Shared,
+                              uint32_t branch = 0) const;
+
+  // Decode the instructions at every address in [start, end) ahead of time,
+  // e.g. the ROM of a machine about to be forked many times, so the forks
+  // share the decoded pages instead of each decoding its own
+  void Predecode(uint16_t start, uint16_t end);
+
+  void SetEngine(Engine e) { engine = e; }
+  Engine GetEngine() const { return engine; }
+
+  // Pick the handlers built for a quirk profile (see quirks.h), typically
+  // right before LoadROM(). Decoded and translated code is dropped.
+  void SetQuirks(QuirkProfile profile);
+  QuirkProfile GetQuirks() const { return quirks; }
+
+  // Blocks compiled ahead of time from the ROM, run by the Aot engine. Load
+  // the ROM itself with LoadROM() as usual; blocks whose bytes are not in
+  // memory, or are overwritten later, are left to the interpreter.
+  void SetAotProgram(const AotProgram *program);
+
+  // Number of predecoded instructions thrown away because the program wrote
+  // over them. A steadily growing count means the ROM defeats the cache.
+  uint64_t CacheInvalidations() const { return cacheInvalidations; }
+
+  // Hosts can stop calling RunFrames() while the machine waits for a key and
+  // both timers are zero, since nothing can change until the next key event.
+  IdleState Idle() const { return idle; }
+  uint64_t IdleFrames() const { return idleFrames; }
+
+  // Instructions actually executed by Run() and RunFrames(), which is less
+  // than the budget they were given whenever idle detection ended a slice
+  // early. Throughput figures should be based on this.
+  uint64_t InstructionsExecuted() const { return instructionsExecuted; }
+  uint8_t DelayTimer() const { return delayTimer; }
+  uint8_t SoundTimer() const { return soundTimer; }
+
+  using Chip8State::keypad;
+  using Chip8State::video;
+
+  // Current resolution. Row y of the framebuffer is the RowWords() words at
+  // video[y * RowWords()].
+  bool HighRes() const { return hires; }
+  unsigned int Width() const { return hires ? HIRES_WIDTH : VIDEO_WIDTH; }
+  unsigned int Height() const { return hires ? HIRES_HEIGHT : VIDEO_HEIGHT; }
+  unsigned int RowWords() const { return hires ? 2 : 1; }
+
+  // Rows touched by 00E0/Dxyn/scrolls since the last TakeDirtyRows(), bit n
+  // for row n. TakeDirtyRows() drops rows whose contents ended up the same as
+  // when they were last taken (e.g. a sprite erased and redrawn in place), so
+  // presenters and headless consumers can skip frames where nothing changed
+  // and upload only the rows that did. After a resolution change it returns
+  // every row.
+  uint64_t DirtyRows() const { return dirtyRows; }
+  bool FrameChanged() const { return dirtyRows != 0; }
+  uint64_t TakeDirtyRows();
+
+  // Memory pages written since the last TakeDirtyPages(), bit n for the page
+  // at n * MEMORY_PAGE_SIZE. Loading a ROM or a state marks every page.
+  uint64_t TakeDirtyPages() {
+    uint64_t pages = dirtyPages;
+    dirtyPages = 0;
+    return pages;
+  }
+
+#ifdef CHIP8_PROFILE
+  // Profiling builds only, see profile.h. Write() dumps the report and the
+  // collapsed stacks, labelled with the handlers now in memory.
+  Profile &GetProfile() { return *profile; }
+  bool WriteProfile(char const *prefix) const {
+    return profile->Write(prefix, memory);
+  }
+#endif
+
+private:
+  friend class Jit;
+  friend class Chip8Lanes;
+  friend class Chip8Pool;
+
+#ifdef CHIP8_PROFILE
+  std::unique_ptr<Profile> profile{new Profile};
+#endif
+
+  // A decoded instruction: the resolved handler plus its operands, extracted
+  // once when the instruction is first executed. The handler is a plain
+  // function pointer (a Call<> thunk with the member function inlined into
+  // it) rather than a 16-byte pointer to member, which halves the size of a
+  // predecode cache entry and saves the virtual-function check on the call.
+  struct Instruction;
+  typedef void (Chip8::*Chip8Func)(const Instruction &);
+  typedef void (*Handler)(Chip8 &, const Instruction &);
+
+  struct Instruction {
+    Handler handler; // nullptr when the entry has not been decoded
+    uint16_t opcode;
+    uint16_t nnn;
+    uint8_t x;
+    uint8_t y;
+    uint8_t kk;
+    uint8_t n;
+  };
+
+  template <Chip8Func Op>
+  static void Call(Chip8 &chip8, const Instruction &ins) {
+    (chip8.*Op)(ins);
+  }
+
+  // Opcode to handler tables, built once per quirk profile and shared by
+  // every instance (see GetDispatch())
+  struct Dispatch;
+  const Dispatch *dispatch;
+
+  unsigned int instructionsPerFrame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+  Engine engine = CHIP8_DEFAULT_ENGINE;
+  QuirkProfile quirks = QuirkProfile::Modern;
+
+  // Instructions left in the current Run(). Idle detection ends the slice
+  // early with SkipBudget().
+  uint64_t budget{};
+  uint64_t dirtyRows = ~0ull;
+  uint64_t takenVideo[VIDEO_WORDS]{}; // video as of the last TakeDirtyRows()
+  bool takenHires = false;
+  uint64_t dirtyPages = ~0ull;
+  IdleState idle = IdleState::Running;
+  uint64_t frameCount{};
+  uint64_t idleFrames{};
+  uint64_t instructionsExecuted{};
+
+  // Bumped by every instruction that changes memory, the framebuffer or the
+  // random number generator, i.e. state not captured by LoopSnapshot.
+  uint64_t sideEffects{};
+
+  // Machine state at the last backward jump, for idle loop detection
+  struct LoopSnapshot {
+    uint64_t frame = ~0ull;
+    uint64_t sideEffects;
+    uint16_t jump;
+    uint16_t index;
+    uint8_t sp;
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+    uint8_t registers[16];
+  };
+  LoopSnapshot loop;
+
+  // Predecode cache, one page per memory page, indexed by the address of the
+  // instruction. Pages nothing was decoded in point at one shared empty page;
+  // a page of its own is allocated the first time code in it is decoded, so
+  // a machine only holds the pages it runs code from. Forks share their
+  // parent's pages, counting references, until one side has to change one,
+  // see WritablePage().
+  struct DecodePage {
+    Instruction entries[MEMORY_PAGE_SIZE]{};
+    std::atomic<unsigned int> references{1};
+  };
+  static DecodePage *EmptyPage();
+  static void Retain(DecodePage *page);
+  static void Release(DecodePage *page);
+  DecodePage *decodePages[MEMORY_PAGES];
+  uint64_t cacheInvalidations{};
+  Instruction *WritablePage(unsigned int page);
+  void ClearDecodeCache();
+
+  // Fetch, decode and execute a single instruction
+  void Step();
+  Handler Lookup(uint16_t opcode) const;
+  const Instruction &Decode(uint16_t address);
+  void Fetch(uint16_t address, Instruction &ins) const;
+
+  template <typename Quirks> static const Dispatch &GetDispatch();
+
+  // Alternative interpreter loops, instantiated per quirk profile
+  template <typename Quirks> void Execute(const Instruction &ins);
+  template <typename Quirks> void RunSwitch();
+  template <typename Quirks> void RunThreaded();
+  void RunJit();
+
+  bool AnyKeyDown() const;
+  void CheckIdleLoop(uint16_t jump);
+
+  // End the current Run() slice early; the rest of its budget doesn't count
+  // as executed
+  void SkipBudget() {
+    instructionsExecuted -= budget;
+    budget = 0;
+  }
+
+  // Created the first time the Jit engine runs
+  std::unique_ptr<Jit> jit;
+  void InvalidateCode(uint16_t address);
+
+  // Set by SetAotProgram(). aotStale has a bit for every compiled byte that
+  // memory no longer matches, so only the blocks over them are skipped.
+  const AotProgram *aot{};
+  uint64_t aotStale[MEMORY_SIZE / 64]{};
+  unsigned int aotStaleBytes{};
+  void RunAot();
+  void CheckAotCode(uint16_t address);
+  void CheckAotCode();
+  bool AotBlockCurrent(uint16_t address, unsigned int count) const;
 
   // Random number generation. Used for Cxkk instruction
-  std::default_random_engine randGen;
-  std::uniform_int_distribution<uint8_t> randByte;
+  uint8_t RandomByte();
+
+  // Bit n set for each row n of the current resolution
+  uint64_t AllRows() const { return hires ? ~0ull : 0xFFFFFFFFull; }
+  void SetResolution(bool high);
+  template <typename Quirks>
+  void DrawHighRes(unsigned int x, unsigned int y, unsigned int height);
 
   // Chip8 instructions
   // CLS
-  void OP_00E0();
+  void OP_00E0(const Instruction &ins);
 
   // RET
-  void OP_00EE();
+  void OP_00EE(const Instruction &ins);
+
+  // SCD nibble (SUPER-CHIP)
+  void OP_00Cn(const Instruction &ins);
+
+  // SCR (SUPER-CHIP)
+  void OP_00FB(const Instruction &ins);
+
+  // SCL (SUPER-CHIP)
+  void OP_00FC(const Instruction &ins);
+
+  // LOW (SUPER-CHIP)
+  void OP_00FE(const Instruction &ins);
+
+  // HIGH (SUPER-CHIP)
+  void OP_00FF(const Instruction &ins);
 
   // JP addr
-  void OP_1nnn();
+  void OP_1nnn(const Instruction &ins);
 
   // CALL addr
-  void OP_2nnn();
+  void OP_2nnn(const Instruction &ins);
 
   // SE Vx, byte
-  void OP_3xkk();
+  void OP_3xkk(const Instruction &ins);
 
   // SNE Vx, byte
-  void OP_4xkk();
+  void OP_4xkk(const Instruction &ins);
 
   // SE Vx, Vy
-  void OP_5xy0();
+  void OP_5xy0(const Instruction &ins);
 
   // LD Vx, byte
-  void OP_6xkk();
+  void OP_6xkk(const Instruction &ins);
 
   // ADD Vx, byte
-  void OP_7xkk();
+  void OP_7xkk(const Instruction &ins);
 
   // LD Vx, Vy
-  void OP_8xy0();
+  void OP_8xy0(const Instruction &ins);
 
   // OR Vx, Vy
-  void OP_8xy1();
+  void OP_8xy1(const Instruction &ins);
 
   // AND Vx, Vy
-  void OP_8xy2();
+  void OP_8xy2(const Instruction &ins);
 
   // XOR Vx, Vy
-  void OP_8xy3();
+  void OP_8xy3(const Instruction &ins);
 
   // ADD Vx, Vy
-  void OP_8xy4();
+  void OP_8xy4(const Instruction &ins);
 
   // SUB Vx, Vy
-  void OP_8xy5();
+  void OP_8xy5(const Instruction &ins);
 
   // SHR Vx {, Vy}
-  void OP_8xy6();
+  template <typename Quirks> void OP_8xy6(const Instruction &ins);
 
   // SUBN Vx, Vy
-  void OP_8xy7();
+  void OP_8xy7(const Instruction &ins);
 
   // SHL Vx {, Vy}
-  void OP_8xyE();
+  template <typename Quirks> void OP_8xyE(const Instruction &ins);
 
   // SNE Vx, Vy
-  void OP_9xy0();
+  void OP_9xy0(const Instruction &ins);
 
   // LD I, addr
-  void OP_Annn();
+  void OP_Annn(const Instruction &ins);
 
   // JP V0, addr:
-  void OP_Bnnn();
+  template <typename Quirks> void OP_Bnnn(const Instruction &ins);
 
   // RND Vx, byte
-  void OP_Cxkk();
+  void OP_Cxkk(const Instruction &ins);
 
   // DRW Vx, Vy, nibble
-  void OP_Dxyn();
+  template <typename Quirks> void OP_Dxyn(const Instruction &ins);
 
   // SKP Vx
-  void OP_Ex9E();
+  void OP_Ex9E(const Instruction &ins);
 
   // SKNP Vx
-  void OP_ExA1();
+  void OP_ExA1(const Instruction &ins);
 
   // LD Vx, DT
-  void OP_Fx07();
+  void OP_Fx07(const Instruction &ins);
 
   // LD Vx, K
-  void OP_Fx0A();
+  void OP_Fx0A(const Instruction &ins);
 
   // LD DT, Vx
-  void OP_Fx15();
+  void OP_Fx15(const Instruction &ins);
 
   // LD ST, Vx
-  void OP_Fx18();
+  void OP_Fx18(const Instruction &ins);
 
   // ADD I, Vx
-  void OP_Fx1E();
+  void OP_Fx1E(const Instruction &ins);
 
   // LD F, Vx
-  void OP_Fx29();
+  void OP_Fx29(const Instruction &ins);
+
+  // LD HF, Vx (SUPER-CHIP)
+  void OP_Fx30(const Instruction &ins);
 
   // LD B, Vx
-  void OP_Fx33();
+  void OP_Fx33(const Instruction &ins);
 
   // LD [I], Vx
-  void OP_Fx55();
+  template <typename Quirks> void OP_Fx55(const Instruction &ins);
 
   // LD Vx, [I]
-  void OP_Fx65();
+  template <typename Quirks> void OP_Fx65(const Instruction &ins);
 
   // Do nothing - Default function table function.
-  void OP_NULL();
-
-  // Declare the function pointer table and subtables
-  void Table0();
-  void Table8();
-  void TableE();
-  void TableF();
-
-  typedef void (Chip8::*Chip8Func)();
-  Chip8Func table[0xF + 1];
-  Chip8Func table0[0xE + 1];
-  Chip8Func table8[0xE + 1];
-  Chip8Func tableE[0xE + 1];
-  Chip8Func tableF[0x65 + 1];
+  void OP_NULL(const Instruction &ins);
 };
\ No newline at end of file
@@ -0,0 +1,214 @@
+#include "chip8_env.h"
+#include "chip8.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+static_assert(CHIP8_ENV_OBSERVATION_WORDS == VIDEO_HEIGHT,
+              "observations are one word per low resolution row");
+
+namespace {
+
+struct Episode {
+  uint32_t number;
+  unsigned int frames;
+  unsigned int stalledFrames;
+};
+
+// OR each pair of adjacent pixels of a 64-pixel word into one pixel of the
+// 32-bit result, keeping their order
+uint64_t HalveRow(uint64_t pixels) {
+  uint64_t x = (pixels | pixels >> 1) & 0x5555555555555555ull;
+  x = (x | x >> 1) & 0x3333333333333333ull;
+  x = (x | x >> 2) & 0x0F0F0F0F0F0F0F0Full;
+  x = (x | x >> 4) & 0x00FF00FF00FF00FFull;
+  x = (x | x >> 8) & 0x0000FFFF0000FFFFull;
+  return (x | x >> 16) & 0x00000000FFFFFFFFull;
+}
+
+void Observe(const Chip8 &machine, uint64_t *observation) {
+  if (!machine.HighRes()) {
+    std::memcpy(observation, machine.video,
+                CHIP8_ENV_OBSERVATION_WORDS * sizeof(uint64_t));
+    return;
+  }
+  for (unsigned int y = 0; y < CHIP8_ENV_OBSERVATION_WORDS; ++y) {
+    const uint64_t *rows = &machine.video[y * 4];
+    observation[y] = HalveRow(rows[0] | rows[2]) << 32 |
+                     HalveRow(rows[1] | rows[3]);
+  }
+}
+
+QuirkProfile ToQuirkProfile(int quirks, bool &ok) {
+  ok = true;
+  switch (quirks) {
+  case CHIP8_ENV_QUIRKS_MODERN:
+    return QuirkProfile::Modern;
+  case CHIP8_ENV_QUIRKS_VIP:
+    return QuirkProfile::Vip;
+  case CHIP8_ENV_QUIRKS_SCHIP:
+    return QuirkProfile::Schip;
+  }
+  ok = false;
+  return QuirkProfile::Modern;
+}
+
+} // namespace
+
+// Every episode starts as a fork of 'initial', the ROM freshly loaded, so
+// resets copy the machine state instead of reloading the ROM.
+struct chip8_env {
+  chip8_env_config config;
+  Chip8 initial;
+  unsigned int count;
+  std::unique_ptr<Chip8[]> machines;
+  std::vector<Episode> episodes;
+  std::unique_ptr<ThreadPool> pool; // none when stepping on one thread
+
+  void Reset(unsigned int i) {
+    Episode &episode = episodes[i];
+    ++episode.number;
+    episode.frames = 0;
+    episode.stalledFrames = 0;
+    initial.ForkInto(machines[i], ForkRng::Split,
+                     i + episode.number * count);
+  }
+
+  // Runs one step of environment i, returns whether its episode ended
+  bool Step(unsigned int i, uint16_t action) {
+    Chip8 &machine = machines[i];
+    Episode &episode = episodes[i];
+    for (unsigned int key = 0; key < KEY_COUNT; ++key) {
+      machine.keypad[key] = (action >> key) & 1;
+    }
+
+    for (unsigned int frame = 0; frame < config.frames_per_step; ++frame) {
+      machine.RunFrames(1);
+      ++episode.frames;
+      bool stalled = machine.Idle() != IdleState::Running &&
+                     machine.DelayTimer() == 0 && machine.SoundTimer() == 0;
+      episode.stalledFrames = stalled ? episode.stalledFrames + 1 : 0;
+
+      if ((config.max_episode_frames &&
+           episode.frames >= config.max_episode_frames) ||
+          (config.max_stalled_frames &&
+           episode.stalledFrames >= config.max_stalled_frames)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Calls work(begin, end) over contiguous ranges of environments, one per
+  // worker, and waits for all of them
+  template <typename Work> void ForEach(Work work) {
+    if (!pool) {
+      work(0u, count);
+      return;
+    }
+    unsigned int tasks = std::min(pool->Size(), count);
+    for (unsigned int task = 0; task < tasks; ++task) {
+      unsigned int begin = uint64_t(count) * task / tasks;
+      unsigned int end = uint64_t(count) * (task + 1) / tasks;
+      pool->Submit([work, begin, end] { work(begin, end); });
+    }
+    pool->Wait();
+  }
+};
+
+chip8_env *chip8_env_create(const uint8_t *rom, size_t size,
+                            unsigned int count,
+                            const chip8_env_config *config) {
+  chip8_env_config settings{};
+  if (config) {
+    settings = *config;
+  }
+  if (settings.threads == 0) {
+    settings.threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  settings.threads = std::min(settings.threads, std::max(count, 1u));
+  if (settings.frames_per_step == 0) {
+    settings.frames_per_step = 1;
+  }
+
+  bool ok;
+  QuirkProfile quirks = ToQuirkProfile(settings.quirks, ok);
+  if (!ok) {
+    std::cerr << "Unknown quirk profile: " << settings.quirks << "\n";
+    return nullptr;
+  }
+  if (count == 0) {
+    std::cerr << "An environment batch needs at least one environment\n";
+    return nullptr;
+  }
+
+  std::unique_ptr<chip8_env> env(new (std::nothrow) chip8_env);
+  if (!env) {
+    std::cerr << "Out of memory\n";
+    return nullptr;
+  }
+  env->config = settings;
+  env->initial.SetQuirks(quirks);
+  if (!env->initial.LoadROM(rom, size)) {
+    return nullptr;
+  }
+  env->initial.Seed(settings.seed);
+
+  // Decoded once here and shared by every environment, until one of them
+  // writes over its code
+  env->initial.Predecode(START_ADDRESS, START_ADDRESS + size);
+  if (settings.instructions_per_frame) {
+    env->initial.SetInstructionsPerFrame(settings.instructions_per_frame);
+  }
+
+  env->count = count;
+  env->machines.reset(new (std::nothrow) Chip8[count]);
+  if (!env->machines) {
+    std::cerr << "Out of memory for " << count << " environments\n";
+    return nullptr;
+  }
+  env->episodes.assign(count, Episode{});
+  if (settings.threads > 1) {
+    env->pool.reset(new ThreadPool(settings.threads));
+  }
+
+  for (unsigned int i = 0; i < count; ++i) {
+    env->Reset(i);
+  }
+  return env.release();
+}
+
+void chip8_env_destroy(chip8_env *env) { delete env; }
+
+unsigned int chip8_env_count(const chip8_env *env) { return env->count; }
+
+void chip8_env_reset(chip8_env *env, uint64_t *observations) {
+  env->ForEach([env, observations](unsigned int begin, unsigned int end) {
+    for (unsigned int i = begin; i < end; ++i) {
+      env->Reset(i);
+      Observe(env->machines[i],
+              &observations[size_t(i) * CHIP8_ENV_OBSERVATION_WORDS]);
+    }
+  });
+}
+
+void chip8_env_step(chip8_env *env, const uint16_t *actions,
+                    uint64_t *observations, uint8_t *dones) {
+  env->ForEach([env, actions, observations, dones](unsigned int begin,
+                                                   unsigned int end) {
+    for (unsigned int i = begin; i < end; ++i) {
+      bool done = env->Step(i, actions[i]);
+      if (done) {
+        env->Reset(i);
+      }
+      dones[i] = done;
+      Observe(env->machines[i],
+              &observations[size_t(i) * CHIP8_ENV_OBSERVATION_WORDS]);
+    }
+  });
+}
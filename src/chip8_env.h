@@ -0,0 +1,71 @@
+#ifndef CHIP8_ENV_H
+#define CHIP8_ENV_H
+
+/*
+ * C interface for training agents: a batch of environments running one ROM,
+ * stepped together on a thread pool. Callers own every buffer; a step writes
+ * observations and done flags straight into them.
+ *
+ * An observation is CHIP8_ENV_OBSERVATION_WORDS 64-bit words, one per row of
+ * the 64x32 display, with bit 63 the leftmost pixel (the layout of
+ * Chip8::video). High resolution SUPER-CHIP screens are reduced to 64x32 by
+ * OR-ing each 2x2 block of pixels. Observations of environment i start at
+ * observations[i * CHIP8_ENV_OBSERVATION_WORDS].
+ *
+ * An action is the keypad state held for the whole step, bit k for key k.
+ *
+ * An episode ends after max_episode_frames frames, or once the program has
+ * been stalled for max_stalled_frames frames in a row: idle with both timers
+ * zero, i.e. waiting on a key press or spinning in a loop the keys don't
+ * break, such as a game over screen. An environment whose episode ended is
+ * reset before the step returns: its done flag is 1 and its observation is
+ * the first of the new episode.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIP8_ENV_OBSERVATION_WORDS 32
+
+/* Quirk profiles, see quirks.h */
+#define CHIP8_ENV_QUIRKS_MODERN 0
+#define CHIP8_ENV_QUIRKS_VIP 1
+#define CHIP8_ENV_QUIRKS_SCHIP 2
+
+/* A zeroed config, or NULL, gives the defaults */
+typedef struct chip8_env_config {
+  unsigned int threads;                /* 0: one per hardware thread */
+  unsigned int frames_per_step;        /* 60 Hz frames per step, 0: 1 */
+  unsigned int instructions_per_frame; /* 0: the emulator's default */
+  unsigned int max_episode_frames;     /* 0: no limit */
+  unsigned int max_stalled_frames;     /* 0: no limit */
+  int quirks;                          /* CHIP8_ENV_QUIRKS_* */
+  uint32_t seed; /* environments and episodes get distinct streams from it */
+} chip8_env_config;
+
+typedef struct chip8_env chip8_env;
+
+/* Returns NULL, printing the reason, if the ROM or config is unusable */
+chip8_env *chip8_env_create(const uint8_t *rom, size_t size,
+                            unsigned int count,
+                            const chip8_env_config *config);
+void chip8_env_destroy(chip8_env *env);
+
+unsigned int chip8_env_count(const chip8_env *env);
+
+/* Starts a new episode in every environment */
+void chip8_env_reset(chip8_env *env, uint64_t *observations);
+
+/* actions and dones hold one entry per environment */
+void chip8_env_step(chip8_env *env, const uint16_t *actions,
+                    uint64_t *observations, uint8_t *dones);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "chip8.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Recycles machines for Fork(), so thousands of forks per frame neither
+// allocate nor construct a Chip8 each. Machines are allocated CHUNK_SIZE at a
+// time and go back on the free list when their Handle is destroyed. A machine
+// given back drops its share of the predecoded code straight away, so the
+// machines still running don't have to copy theirs the next time they decode.
+//
+// Not thread safe: use one pool per thread. Handles must not outlive their
+// pool.
+class Chip8Pool {
+public:
+  class Release {
+  public:
+    explicit Release(Chip8Pool *pool = nullptr) : pool(pool) {}
+    void operator()(Chip8 *machine) const { pool->Put(machine); }
+
+  private:
+    Chip8Pool *pool;
+  };
+  typedef std::unique_ptr<Chip8, Release> Handle;
+
+  // Like parent.Fork(), into a recycled machine
+  Handle Fork(const Chip8 &parent, ForkRng rng = ForkRng::Shared,
+              uint32_t branch = 0) {
+    if (free.empty()) {
+      Grow();
+    }
+    Chip8 *machine = free.back();
+    free.pop_back();
+    parent.ForkInto(*machine, rng, branch);
+    return Handle(machine, Release(this));
+  }
+
+  size_t Allocated() const { return chunks.size() * CHUNK_SIZE; }
+  size_t Available() const { return free.size(); }
+
+private:
+  static const size_t CHUNK_SIZE = 64;
+
+  std::vector<std::unique_ptr<Chip8[]>> chunks;
+  std::vector<Chip8 *> free;
+
+  void Grow() {
+    chunks.emplace_back(new Chip8[CHUNK_SIZE]);
+    for (size_t i = CHUNK_SIZE; i > 0; --i) {
+      free.push_back(&chunks.back()[i - 1]);
+    }
+  }
+
+  void Put(Chip8 *machine) {
+    machine->ClearDecodeCache();
+    free.push_back(machine);
+  }
+};
@@ -0,0 +1,119 @@
+#include "frame_stream.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+namespace {
+
+// Two pixel rows per line of text: top, bottom, both or neither
+const char *const CELLS[4] = {" ", "\xE2\x96\x80", "\xE2\x96\x84",
+                              "\xE2\x96\x88"};
+
+bool Pixel(const uint64_t *video, bool hires, unsigned int x, unsigned int y) {
+  unsigned int rowWords = hires ? 2 : 1;
+  uint64_t word = video[y * rowWords + x / 64];
+  return (word >> (63 - x % 64)) & 1;
+}
+
+// Redraw the whole frame over the previous one
+void Draw(const FrameDecoder &decoder) {
+  bool hires = decoder.HighRes();
+  unsigned int width = hires ? HIRES_WIDTH : VIDEO_WIDTH;
+  unsigned int height = hires ? HIRES_HEIGHT : VIDEO_HEIGHT;
+
+  std::string text = "\x1B[H";
+  for (unsigned int y = 0; y < height; y += 2) {
+    for (unsigned int x = 0; x < width; ++x) {
+      unsigned int cell = Pixel(decoder.Video(), hires, x, y) |
+                          Pixel(decoder.Video(), hires, x, y + 1) << 1;
+      text += CELLS[cell];
+    }
+    text += "\x1B[K\n";
+  }
+  text += "\x1B[J";
+  std::cout << text << std::flush;
+}
+
+} // namespace
+
+// Plays a frame stream written by a frontend's --stream option in the
+// terminal at the speed it was recorded, or with --stats decodes it as fast
+// as possible and reports its size and the hash of the last frame.
+int main(int argc, char **argv) {
+  bool stats = false;
+  int arg = 1;
+
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    if (std::strcmp(argv[arg], "--stats") == 0) {
+      stats = true;
+    } else {
+      std::cerr << "Unknown option: " << argv[arg] << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - arg != 1) {
+    std::cerr << "Usage: " << argv[0] << " [--stats] <Stream|-|shm:/name>\n";
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<FrameSource> source = OpenFrameSource(argv[arg]);
+  if (!source) {
+    return EXIT_FAILURE;
+  }
+
+  FrameDecoder decoder;
+  FrameRecord record;
+  uint64_t records = 0;
+  uint64_t keyframes = 0;
+  uint64_t bytes = 0;
+  uint32_t firstFrame = 0;
+  std::chrono::steady_clock::time_point start;
+
+  while (source->Read(record)) {
+    bool wasSynced = decoder.Synced();
+    if (!decoder.Decode(record)) {
+      std::cerr << "Malformed record for frame " << record.header.frame
+                << "\n";
+      return EXIT_FAILURE;
+    }
+    if (!decoder.Synced()) {
+      continue;
+    }
+
+    ++records;
+    keyframes += (record.header.flags & FRAME_KEY) ? 1 : 0;
+    bytes += sizeof(record.header) + record.header.size;
+    if (stats) {
+      continue;
+    }
+
+    // Frames are shown at their 60 Hz timestamps, relative to the first
+    if (!wasSynced) {
+      firstFrame = decoder.Frame();
+      start = std::chrono::steady_clock::now();
+    }
+    std::this_thread::sleep_until(
+        start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(
+                        (decoder.Frame() - firstFrame) / 60.0)));
+    Draw(decoder);
+  }
+
+  if (stats) {
+    std::cout << records << " frames (" << keyframes << " keyframes), "
+              << bytes << " bytes, " << std::fixed << std::setprecision(1)
+              << (records ? double(bytes) / records : 0.0)
+              << " bytes/frame, last frame " << decoder.Frame() << " hash "
+              << std::hex << std::setw(16) << std::setfill('0')
+              << (decoder.Synced()
+                      ? FrameHash(decoder.Video(), decoder.HighRes())
+                      : 0)
+              << "\n";
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,570 @@
+#include "frame_stream.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define CHIP8_SHM_RING
+#endif
+
+namespace {
+
+// File and pipe streams start with the magic and version, then records one
+// after another: a FrameRecordHeader followed by its payload, all in host
+// byte order. Bump FRAME_STREAM_VERSION whenever the format changes.
+const char FRAME_STREAM_MAGIC[4] = {'C', '8', 'F', 'S'};
+const uint32_t FRAME_STREAM_VERSION = 1;
+
+const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+// Fewer zero bytes than this are cheaper to keep inside a literal run than
+// to split it with another run header
+const unsigned int MIN_ZERO_RUN = 3;
+const unsigned int MAX_RUN = 0xFF;
+
+// How long the writer thread and file-less readers sleep when there is
+// nothing to do; well under a 60 Hz frame
+const std::chrono::milliseconds POLL_INTERVAL(1);
+
+unsigned int Height(bool hires) { return hires ? HIRES_HEIGHT : VIDEO_HEIGHT; }
+unsigned int RowWords(bool hires) { return hires ? 2 : 1; }
+uint64_t AllRows(bool hires) { return hires ? ~0ull : 0xFFFFFFFFull; }
+
+// Appends 'count' XOR bytes as (zero bytes, literal bytes) runs. Trailing
+// zero bytes are left out.
+size_t EncodeRuns(const uint8_t *bytes, size_t count, uint8_t *out) {
+  uint8_t *start = out;
+  size_t i = 0;
+
+  while (i < count) {
+    size_t zeros = 0;
+    while (zeros < MAX_RUN && i + zeros < count && bytes[i + zeros] == 0) {
+      ++zeros;
+    }
+    if (i + zeros == count) {
+      break; // only zero bytes left
+    }
+    i += zeros;
+
+    size_t literal = 0;
+    while (literal < MAX_RUN && i + literal < count) {
+      size_t run = 0;
+      while (run < MIN_ZERO_RUN && i + literal + run < count &&
+             bytes[i + literal + run] == 0) {
+        ++run;
+      }
+      if (run == MIN_ZERO_RUN || i + literal + run == count) {
+        break;
+      }
+      literal += run + 1;
+    }
+    if (literal > MAX_RUN) {
+      literal = MAX_RUN;
+    }
+
+    *out++ = static_cast<uint8_t>(zeros);
+    *out++ = static_cast<uint8_t>(literal);
+    std::memcpy(out, bytes + i, literal);
+    out += literal;
+    i += literal;
+  }
+  return out - start;
+}
+
+// Expands runs into 'bytes', which must be zeroed. Fails on runs that don't
+// fit in 'count' bytes.
+bool DecodeRuns(const uint8_t *runs, size_t size, uint8_t *bytes,
+                size_t count) {
+  const uint8_t *end = runs + size;
+  size_t i = 0;
+
+  while (runs < end) {
+    if (end - runs < 2) {
+      return false;
+    }
+    size_t zeros = runs[0];
+    size_t literal = runs[1];
+    runs += 2;
+    if (size_t(end - runs) < literal || i + zeros + literal > count) {
+      return false;
+    }
+    i += zeros;
+    std::memcpy(bytes + i, runs, literal);
+    runs += literal;
+    i += literal;
+  }
+  return true;
+}
+
+// Appends the bytes of 'word' leftmost pixel first
+uint8_t *PutWord(uint64_t word, uint8_t *out) {
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    *out++ = static_cast<uint8_t>(word >> shift);
+  }
+  return out;
+}
+
+uint64_t GetWord(const uint8_t *bytes) {
+  uint64_t word = 0;
+  for (unsigned int i = 0; i < 8; ++i) {
+    word = (word << 8) | bytes[i];
+  }
+  return word;
+}
+
+class FileSink : public FrameSink {
+public:
+  explicit FileSink(std::FILE *file) : file(file) {}
+  ~FileSink() override {
+    if (file != stdout) {
+      std::fclose(file);
+    } else {
+      std::fflush(file);
+    }
+  }
+
+  bool Begin() {
+    return std::fwrite(FRAME_STREAM_MAGIC, sizeof(FRAME_STREAM_MAGIC), 1,
+                       file) == 1 &&
+           std::fwrite(&FRAME_STREAM_VERSION, sizeof(FRAME_STREAM_VERSION), 1,
+                       file) == 1;
+  }
+
+  // Flushed per record so players on the other end of a pipe see every frame
+  // as it is written
+  bool Write(const FrameRecord &record) override {
+    return std::fwrite(&record, sizeof(record.header) + record.header.size, 1,
+                       file) == 1 &&
+           std::fflush(file) == 0;
+  }
+
+private:
+  std::FILE *file;
+};
+
+class FileSource : public FrameSource {
+public:
+  explicit FileSource(std::FILE *file) : file(file) {}
+  ~FileSource() override {
+    if (file != stdin) {
+      std::fclose(file);
+    }
+  }
+
+  bool Begin() {
+    char magic[sizeof(FRAME_STREAM_MAGIC)];
+    uint32_t version = 0;
+    return std::fread(magic, sizeof(magic), 1, file) == 1 &&
+           std::fread(&version, sizeof(version), 1, file) == 1 &&
+           std::memcmp(magic, FRAME_STREAM_MAGIC, sizeof(magic)) == 0 &&
+           version == FRAME_STREAM_VERSION;
+  }
+
+  bool Read(FrameRecord &record) override {
+    return std::fread(&record.header, sizeof(record.header), 1, file) == 1 &&
+           record.header.size <= MAX_FRAME_PAYLOAD &&
+           std::fread(record.payload, record.header.size, 1, file) == 1;
+  }
+
+private:
+  std::FILE *file;
+};
+
+#ifdef CHIP8_SHM_RING
+
+// A shared memory stream is a ring of the most recent records, one fixed
+// size slot each. Record n goes in slot n % SHM_SLOTS, guarded by a seqlock:
+// the writer sets the slot's 'seq' to the odd 2n + 1, fills the slot, sets
+// 'seq' to 2n + 2 and then publishes the record by bumping 'published' to
+// n + 1. A reader copies a record out only between two reads of 'seq' that
+// both found 2n + 2. Holds more records than KEYFRAME_INTERVAL, so there is
+// always a keyframe to join at.
+const uint32_t SHM_SLOTS = 512;
+
+// Version of the ring's layout, independent of the file format's
+const uint32_t SHM_RING_VERSION = 2;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "the ring's atomics must work across processes");
+
+struct ShmSlot {
+  std::atomic<uint64_t> seq;
+  FrameRecord record;
+};
+
+struct ShmRing {
+  char magic[4];
+  uint32_t version;
+  uint32_t slots;
+  std::atomic<uint32_t> closed; // the writer has finished
+  std::atomic<uint64_t> published;
+  ShmSlot records[SHM_SLOTS];
+};
+
+class ShmSink : public FrameSink {
+public:
+  ShmSink(const std::string &name, ShmRing *ring) : name(name), ring(ring) {}
+
+  // Readers already attached finish the records left in the ring
+  ~ShmSink() override {
+    ring->closed.store(1, std::memory_order_release);
+    munmap(ring, sizeof(ShmRing));
+    shm_unlink(name.c_str());
+  }
+
+  bool Write(const FrameRecord &record) override {
+    uint64_t n = ring->published.load(std::memory_order_relaxed);
+    ShmSlot &slot = ring->records[n % SHM_SLOTS];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&slot.record, &record,
+                sizeof(record.header) + record.header.size);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+    ring->published.store(n + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::string name;
+  ShmRing *ring;
+};
+
+class ShmSource : public FrameSource {
+public:
+  explicit ShmSource(const ShmRing *ring) : ring(ring) {
+    // Start at the newest keyframe, or the oldest record when there is none
+    uint64_t published = ring->published.load(std::memory_order_acquire);
+    uint64_t oldest = published > SHM_SLOTS - 1 ? published - SHM_SLOTS + 1 : 0;
+    next = published;
+    while (next > oldest &&
+           !(ring->records[(next - 1) % SHM_SLOTS].record.header.flags &
+             FRAME_KEY)) {
+      --next;
+    }
+    next = next > oldest ? next - 1 : oldest;
+  }
+
+  ~ShmSource() override {
+    munmap(const_cast<ShmRing *>(ring), sizeof(ShmRing));
+  }
+
+  bool Read(FrameRecord &record) override {
+    for (;;) {
+      uint64_t published = ring->published.load(std::memory_order_acquire);
+      if (next == published) {
+        if (ring->closed.load(std::memory_order_acquire) &&
+            ring->published.load(std::memory_order_acquire) == next) {
+          return false;
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+        continue;
+      }
+
+      // Fell behind: skip to the middle of what is left in the ring
+      if (published - next >= SHM_SLOTS) {
+        next = published - SHM_SLOTS / 2;
+      }
+
+      // The copy is only good if the slot held record 'next' before and
+      // after it; otherwise the writer has got back round to the slot, and
+      // the next pass skips ahead
+      const ShmSlot &slot = ring->records[next % SHM_SLOTS];
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq != 2 * next + 2) {
+        continue;
+      }
+      std::memcpy(&record.header, &slot.record.header, sizeof(record.header));
+      size_t size = record.header.size;
+      std::memcpy(record.payload, slot.record.payload,
+                  size <= MAX_FRAME_PAYLOAD ? size : MAX_FRAME_PAYLOAD);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq) {
+        continue;
+      }
+      ++next;
+      if (size > MAX_FRAME_PAYLOAD) {
+        return false;
+      }
+      return true;
+    }
+  }
+
+private:
+  const ShmRing *ring;
+  uint64_t next;
+};
+
+std::unique_ptr<FrameSink> OpenShmSink(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+  void *memory = MAP_FAILED;
+  if (ftruncate(fd, sizeof(ShmRing)) == 0) {
+    memory = mmap(nullptr, sizeof(ShmRing), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (memory == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+
+  // The segment starts zeroed; readers check the magic, written last
+  ShmRing *ring = static_cast<ShmRing *>(memory);
+  ring->version = SHM_RING_VERSION;
+  ring->slots = SHM_SLOTS;
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(ring->magic, FRAME_STREAM_MAGIC, sizeof(FRAME_STREAM_MAGIC));
+  return std::unique_ptr<FrameSink>(new ShmSink(name, ring));
+}
+
+std::unique_ptr<FrameSource> OpenShmSource(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  void *memory =
+      mmap(nullptr, sizeof(ShmRing), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const ShmRing *ring = static_cast<const ShmRing *>(memory);
+  if (std::memcmp(ring->magic, FRAME_STREAM_MAGIC, sizeof(ring->magic)) != 0 ||
+      ring->version != SHM_RING_VERSION || ring->slots != SHM_SLOTS) {
+    munmap(memory, sizeof(ShmRing));
+    return nullptr;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return std::unique_ptr<FrameSource>(new ShmSource(ring));
+}
+
+#endif
+
+const char SHM_PREFIX[] = "shm:";
+
+bool IsShm(char const *target) {
+  return std::strncmp(target, SHM_PREFIX, sizeof(SHM_PREFIX) - 1) == 0;
+}
+
+} // namespace
+
+uint64_t FrameHash(const uint64_t *video, bool hires) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  unsigned int words = Height(hires) * RowWords(hires);
+  for (unsigned int i = 0; i < words; ++i) {
+    uint8_t bytes[8];
+    PutWord(video[i], bytes);
+    for (uint8_t byte : bytes) {
+      hash = (hash ^ byte) * FNV_PRIME;
+    }
+  }
+  return hash;
+}
+
+bool FrameEncoder::Encode(const uint64_t *video, bool hires, uint32_t frame,
+                          FrameRecord &record) {
+  unsigned int rowWords = RowWords(hires);
+  bool key = !started || hires != previousHires ||
+             sinceKeyframe >= KEYFRAME_INTERVAL;
+
+  uint64_t rows = 0;
+  if (key) {
+    std::memset(previous, 0, sizeof(previous));
+    rows = AllRows(hires);
+  } else {
+    for (unsigned int y = 0; y < Height(hires); ++y) {
+      if (std::memcmp(video + y * rowWords, previous + y * rowWords,
+                      rowWords * sizeof(*video))) {
+        rows |= 1ull << y;
+      }
+    }
+    if (rows == 0) {
+      return false;
+    }
+  }
+
+  // The XOR of the covered rows, then runs of it after the row mask
+  uint8_t diff[VIDEO_WORDS * sizeof(uint64_t)];
+  uint8_t *out = diff;
+  for (uint64_t pending = rows; pending; pending &= pending - 1) {
+    unsigned int y = __builtin_ctzll(pending);
+    for (unsigned int w = y * rowWords; w < (y + 1) * rowWords; ++w) {
+      out = PutWord(video[w] ^ previous[w], out);
+    }
+  }
+
+  std::memcpy(record.payload, &rows, sizeof(rows));
+  size_t size = sizeof(rows) +
+                EncodeRuns(diff, out - diff, record.payload + sizeof(rows));
+
+  record.header.frame = frame;
+  record.header.flags = (key ? FRAME_KEY : 0) | (hires ? FRAME_HIRES : 0);
+  record.header.reserved = 0;
+  record.header.size = static_cast<uint16_t>(size);
+
+  std::memcpy(previous, video, sizeof(previous));
+  previousHires = hires;
+  started = true;
+  sinceKeyframe = key ? 1 : sinceKeyframe + 1;
+  return true;
+}
+
+bool FrameDecoder::Decode(const FrameRecord &record) {
+  const FrameRecordHeader &header = record.header;
+  bool key = header.flags & FRAME_KEY;
+  bool high = header.flags & FRAME_HIRES;
+  if (header.size < sizeof(uint64_t) || header.size > MAX_FRAME_PAYLOAD) {
+    return false;
+  }
+  if (!key && !synced) {
+    return true; // waiting for a keyframe
+  }
+  if (!key && high != hires) {
+    return false; // resolution changes always come as keyframes
+  }
+
+  uint64_t rows;
+  std::memcpy(&rows, record.payload, sizeof(rows));
+  if (rows & ~AllRows(high)) {
+    return false;
+  }
+
+  unsigned int rowWords = RowWords(high);
+  size_t count = __builtin_popcountll(rows) * rowWords * sizeof(uint64_t);
+  uint8_t diff[VIDEO_WORDS * sizeof(uint64_t)] = {};
+  if (!DecodeRuns(record.payload + sizeof(rows), header.size - sizeof(rows),
+                  diff, count)) {
+    return false;
+  }
+
+  if (key) {
+    std::memset(video, 0, sizeof(video));
+    hires = high;
+    synced = true;
+  }
+
+  const uint8_t *in = diff;
+  for (uint64_t pending = rows; pending; pending &= pending - 1) {
+    unsigned int y = __builtin_ctzll(pending);
+    for (unsigned int w = y * rowWords; w < (y + 1) * rowWords; ++w) {
+      video[w] ^= GetWord(in);
+      in += sizeof(uint64_t);
+    }
+  }
+  frame = header.frame;
+  return true;
+}
+
+std::unique_ptr<FrameSink> OpenFrameSink(char const *target) {
+  if (IsShm(target)) {
+#ifdef CHIP8_SHM_RING
+    std::unique_ptr<FrameSink> sink =
+        OpenShmSink(target + sizeof(SHM_PREFIX) - 1);
+    if (!sink) {
+      std::cerr << "Failed to create shared memory " << target << "\n";
+    }
+    return sink;
+#else
+    std::cerr << "Shared memory streams are not supported here\n";
+    return nullptr;
+#endif
+  }
+
+  std::FILE *file =
+      std::strcmp(target, "-") == 0 ? stdout : std::fopen(target, "wb");
+  if (!file) {
+    std::cerr << "Failed to open " << target << "\n";
+    return nullptr;
+  }
+  std::unique_ptr<FileSink> sink(new FileSink(file));
+  if (!sink->Begin()) {
+    std::cerr << "Failed to write " << target << "\n";
+    return nullptr;
+  }
+  return std::unique_ptr<FrameSink>(sink.release());
+}
+
+std::unique_ptr<FrameSource> OpenFrameSource(char const *target) {
+  if (IsShm(target)) {
+#ifdef CHIP8_SHM_RING
+    std::unique_ptr<FrameSource> source =
+        OpenShmSource(target + sizeof(SHM_PREFIX) - 1);
+    if (!source) {
+      std::cerr << "No frame stream in shared memory " << target << "\n";
+    }
+    return source;
+#else
+    std::cerr << "Shared memory streams are not supported here\n";
+    return nullptr;
+#endif
+  }
+
+  std::FILE *file =
+      std::strcmp(target, "-") == 0 ? stdin : std::fopen(target, "rb");
+  if (!file) {
+    std::cerr << "Failed to open " << target << "\n";
+    return nullptr;
+  }
+  std::unique_ptr<FileSource> source(new FileSource(file));
+  if (!source->Begin()) {
+    std::cerr << "Not a compatible frame stream: " << target << "\n";
+    return nullptr;
+  }
+  return std::unique_ptr<FrameSource>(source.release());
+}
+
+FrameStreamWriter::FrameStreamWriter(std::unique_ptr<FrameSink> sink)
+    : sink(std::move(sink)) {
+  thread = std::thread(&FrameStreamWriter::WriteLoop, this);
+}
+
+FrameStreamWriter::~FrameStreamWriter() {
+  stop.store(true, std::memory_order_release);
+  thread.join();
+}
+
+bool FrameStreamWriter::Submit(const Chip8 &chip8, uint32_t frame) {
+  Pending item;
+  std::memcpy(item.video, chip8.video, sizeof(item.video));
+  item.frame = frame;
+  item.hires = chip8.HighRes();
+  if (!pending.TryPush(item)) {
+    ++dropped;
+    return false;
+  }
+  return true;
+}
+
+void FrameStreamWriter::WriteLoop() {
+  FrameEncoder encoder;
+  FrameRecord record;
+
+  for (;;) {
+    // Anything submitted before stop was set is in the ring by now
+    bool stopping = stop.load(std::memory_order_acquire);
+    const Pending *item = pending.Peek();
+    if (!item) {
+      if (stopping) {
+        return;
+      }
+      std::this_thread::sleep_for(POLL_INTERVAL);
+      continue;
+    }
+
+    if (!Failed() &&
+        encoder.Encode(item->video, item->hires, item->frame, record) &&
+        !sink->Write(record)) {
+      failed.store(true, std::memory_order_relaxed);
+    }
+    pending.Pop();
+  }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "chip8.h"
+#include "spsc_ring.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+// Compact stream of the frames a session displayed, for viewers and
+// recorders that don't run the emulator. Each record holds one changed frame
+// of the 1-bit framebuffer, tagged with the 60 Hz frame it was shown on:
+// either a keyframe, or the rows that changed since the previous record,
+// XORed with their old contents and run-length encoded. Keyframes are
+// written first, on resolution changes and every KEYFRAME_INTERVAL records,
+// so a player can join a stream part way through.
+//
+// A payload is the 64-bit mask of the rows it covers (all of them for a
+// keyframe), then the XOR of those rows, row after row, as a sequence of
+// (zero bytes, literal bytes) runs: two 8-bit lengths followed by the
+// literal bytes. A keyframe is XORed with a blank screen.
+
+const unsigned int KEYFRAME_INTERVAL = 300;
+
+// Record flags
+const uint8_t FRAME_KEY = 0x1;
+const uint8_t FRAME_HIRES = 0x2;
+
+struct FrameRecordHeader {
+  uint32_t frame; // 60 Hz frames since the session started
+  uint8_t flags;
+  uint8_t reserved;
+  uint16_t size; // of the payload in bytes
+};
+
+// The row mask, and at worst three bytes of runs for every two XOR bytes
+const unsigned int MAX_FRAME_PAYLOAD =
+    sizeof(uint64_t) + 2 * VIDEO_WORDS * sizeof(uint64_t);
+
+struct FrameRecord {
+  FrameRecordHeader header;
+  uint8_t payload[MAX_FRAME_PAYLOAD];
+};
+
+// FNV-1a hash of the rows of a framebuffer in the given resolution, for
+// checking a decoded stream against the machine that produced it
+uint64_t FrameHash(const uint64_t *video, bool hires);
+
+// Turns successive framebuffers into records. Keeps the last frame encoded.
+class FrameEncoder {
+public:
+  // Returns false, writing nothing, when the frame is the same as the last
+  // one encoded
+  bool Encode(const uint64_t *video, bool hires, uint32_t frame,
+              FrameRecord &record);
+
+private:
+  uint64_t previous[VIDEO_WORDS]{};
+  bool previousHires = false;
+  bool started = false;
+  unsigned int sinceKeyframe{};
+};
+
+// Applies records to a framebuffer. Deltas are ignored until the first
+// keyframe, so decoding may start anywhere in a stream.
+class FrameDecoder {
+public:
+  // Returns false for a malformed record
+  bool Decode(const FrameRecord &record);
+
+  // False until a keyframe has been decoded
+  bool Synced() const { return synced; }
+  const uint64_t *Video() const { return video; }
+  bool HighRes() const { return hires; }
+  uint32_t Frame() const { return frame; }
+
+private:
+  uint64_t video[VIDEO_WORDS]{};
+  bool hires = false;
+  bool synced = false;
+  uint32_t frame{};
+};
+
+// Where records go. OpenFrameSink() takes a file or named pipe path, "-" for
+// standard output, or "shm:/name" for a POSIX shared memory ring of the most
+// recent records that any number of players can follow (UNIX only).
+class FrameSink {
+public:
+  virtual ~FrameSink() {}
+  virtual bool Write(const FrameRecord &record) = 0;
+};
+
+// Where records come from, as OpenFrameSink() with "-" for standard input.
+// Read() waits for the next record and returns false at the end of the
+// stream. A player that falls behind a shared memory ring skips ahead.
+class FrameSource {
+public:
+  virtual ~FrameSource() {}
+  virtual bool Read(FrameRecord &record) = 0;
+};
+
+std::unique_ptr<FrameSink> OpenFrameSink(char const *target);
+std::unique_ptr<FrameSource> OpenFrameSource(char const *target);
+
+// Encodes and writes frames on a background thread, so the emulation thread
+// only ever copies the framebuffer into a lock-free ring and never waits on
+// encoding or I/O. When the writer falls behind Submit() drops the frame;
+// the next one is then encoded against the last frame written, so the stream
+// stays consistent and only loses intermediate frames.
+class FrameStreamWriter {
+public:
+  explicit FrameStreamWriter(std::unique_ptr<FrameSink> sink);
+
+  // Writes out the frames already submitted
+  ~FrameStreamWriter();
+
+  // Emulation thread: queue the framebuffer as shown on 'frame'. Returns
+  // false when the ring is full and the frame was dropped.
+  bool Submit(const Chip8 &chip8, uint32_t frame);
+
+  uint64_t Dropped() const { return dropped; }
+  // Set once a write has failed; later frames are discarded
+  bool Failed() const { return failed.load(std::memory_order_relaxed); }
+
+private:
+  struct Pending {
+    uint64_t video[VIDEO_WORDS];
+    uint32_t frame;
+    bool hires;
+  };
+
+  std::unique_ptr<FrameSink> sink;
+  SpscRing<Pending, 64> pending;
+  std::atomic<bool> stop{false};
+  std::atomic<bool> failed{false};
+  uint64_t dropped{}; // emulation thread only
+  std::thread thread;
+
+  void WriteLoop();
+};
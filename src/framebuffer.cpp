@@ -0,0 +1,35 @@
+#include "framebuffer.h"
+#include <cstring>
+
+namespace {
+
+// Lookup table mapping one byte of the packed framebuffer to 8 ABGR pixels.
+struct ExpandTable {
+  uint32_t pixels[256][8];
+
+  ExpandTable() {
+    for (unsigned int byte = 0; byte < 256; ++byte) {
+      for (unsigned int bit = 0; bit < 8; ++bit) {
+        pixels[byte][bit] = (byte & (0x80u >> bit)) ? PIXEL_ON : PIXEL_OFF;
+      }
+    }
+  }
+};
+
+const ExpandTable expandTable;
+
+} // namespace
+
+void ExpandRows(const uint64_t *rows, unsigned int rowCount,
+                uint32_t *pixels) {
+  for (unsigned int y = 0; y < rowCount; ++y) {
+    uint64_t row = rows[y];
+
+    // Walk the row from the leftmost byte (the top of the word) down.
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      std::memcpy(pixels, expandTable.pixels[(row >> shift) & 0xFFu],
+                  sizeof(expandTable.pixels[0]));
+      pixels += 8;
+    }
+  }
+}
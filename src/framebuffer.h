@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+// ABGR colours used when presenting the 1-bit framebuffer
+const uint32_t PIXEL_ON = 0xFFFFFFFF;
+const uint32_t PIXEL_OFF = 0xFF000000;
+
+// Expand packed 64-pixel words (bit 63 is the leftmost pixel) into ABGR
+// pixels, 64 per word, so a high resolution row is two consecutive words.
+// Uses a byte -> 8 pixel lookup table.
+void ExpandRows(const uint64_t *rows, unsigned int rowCount, uint32_t *pixels);
@@ -0,0 +1,384 @@
+#include "chip8.h"
+#include "frame_stream.h"
+#include "lanes.h"
+#include "movie.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct EngineName {
+  const char *name;
+  Engine engine;
+};
+
+const EngineName engineNames[] = {
+    {"table", Engine::Table},
+    {"switch", Engine::Switch},
+    {"threaded", Engine::Threaded},
+    {"jit", Engine::Jit},
+};
+
+// Run a budget of 'cycles' instructions of the ROM on a fresh machine and
+// return the instructions/second achieved. Idle frames execute nothing, so
+// the rate is based on the instructions actually executed.
+double Measure(char const *romFilename, Engine engine, QuirkProfile quirks,
+               uint32_t seed, unsigned int instructionsPerFrame,
+               uint64_t cycles, uint64_t *executed, uint64_t *invalidations,
+               uint64_t *idleFrames, uint64_t *changedFrames, uint64_t *hash) {
+  Chip8 chip8;
+  chip8.SetQuirks(quirks);
+  if (!chip8.LoadROM(romFilename)) {
+    std::exit(EXIT_FAILURE);
+  }
+  chip8.Seed(seed);
+  chip8.SetEngine(engine);
+  chip8.SetInstructionsPerFrame(instructionsPerFrame);
+
+  // Whole 60 Hz frames, then whatever is left of the budget. Count the frames
+  // that changed the display, i.e. the ones a presenter would upload.
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t frames = cycles / instructionsPerFrame; frames > 0; --frames) {
+    chip8.RunFrames(1);
+    if (chip8.TakeDirtyRows()) {
+      ++*changedFrames;
+    }
+  }
+  chip8.Run(cycles % instructionsPerFrame);
+  auto end = std::chrono::steady_clock::now();
+
+#ifdef CHIP8_PROFILE
+  std::string profile = std::string("chip8-profile-") +
+                        engineNames[static_cast<int>(engine)].name;
+  chip8.WriteProfile(profile.c_str());
+#endif
+
+  *executed = chip8.InstructionsExecuted();
+  *invalidations = chip8.CacheInvalidations();
+  *idleFrames = chip8.IdleFrames();
+  *hash = chip8.StateHash();
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return seconds > 0 ? *executed / seconds : 0.0;
+}
+
+// Run the ROM on 'lanes' lockstep lanes, lane i seeded with seed + i, and
+// compare each lane with a Chip8 running the same seed on its own. Prints
+// both throughputs and returns the number of lanes that differ.
+unsigned int MeasureLanes(char const *romFilename, QuirkProfile quirks,
+                          unsigned int lanes, uint32_t seed,
+                          unsigned int instructionsPerFrame, uint64_t cycles) {
+  Chip8 machine;
+  machine.SetQuirks(quirks);
+  if (!machine.LoadROM(romFilename)) {
+    std::exit(EXIT_FAILURE);
+  }
+  machine.SetInstructionsPerFrame(instructionsPerFrame);
+  unsigned int frames = cycles / instructionsPerFrame;
+
+  Chip8Lanes lockstep(machine, lanes);
+  for (unsigned int i = 0; i < lanes; ++i) {
+    lockstep.Seed(i, seed + i);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  lockstep.RunFrames(frames);
+  auto end = std::chrono::steady_clock::now();
+  double lockstepSeconds = std::chrono::duration<double>(end - start).count();
+
+  Chip8State state;
+  machine.SaveState(state);
+  double singleSeconds = 0;
+  unsigned int mismatches = 0;
+
+  for (unsigned int i = 0; i < lanes; ++i) {
+    Chip8 single;
+    single.SetQuirks(quirks);
+    single.LoadState(state);
+    single.Seed(seed + i);
+    single.SetInstructionsPerFrame(instructionsPerFrame);
+
+    start = std::chrono::steady_clock::now();
+    single.RunFrames(frames);
+    end = std::chrono::steady_clock::now();
+    singleSeconds += std::chrono::duration<double>(end - start).count();
+
+    if (single.StateHash() != lockstep.Lane(i).StateHash()) {
+      ++mismatches;
+    }
+  }
+
+  uint64_t instructions =
+      lockstep.LockstepInstructions() + lockstep.ScalarInstructions();
+  std::cout << std::fixed << std::setprecision(1) << "lanes      " << lanes
+            << " lanes, " << instructions << " instructions, "
+            << (lockstepSeconds > 0 ? instructions / lockstepSeconds / 1e6 : 0)
+            << " M instructions/s ("
+            << 100.0 * lockstep.LockstepInstructions() /
+                   (instructions ? instructions : 1)
+            << "% in lockstep), one Chip8 per lane "
+            << (singleSeconds > 0 ? instructions / singleSeconds / 1e6 : 0)
+            << " M instructions/s, " << lanes - mismatches << "/" << lanes
+            << " lanes match\n";
+  std::cout.unsetf(std::ios::fixed);
+  return mismatches;
+}
+
+// Run 'frames' frames of the ROM and write the ones that changed the display
+// to a frame stream. Nothing is timing-critical here, so a full writer ring
+// is waited out instead of dropping frames.
+bool StreamFrames(char const *romFilename, char const *target, Engine engine,
+                  QuirkProfile quirks, uint32_t seed,
+                  unsigned int instructionsPerFrame, uint32_t frames) {
+  // Loaded from a buffer, which prints nothing, so "-" can stream to stdout
+  std::vector<uint8_t> rom;
+  Chip8 chip8;
+  chip8.SetQuirks(quirks);
+  if (!ReadFile(romFilename, rom) || !chip8.LoadROM(rom.data(), rom.size())) {
+    return false;
+  }
+  chip8.Seed(seed);
+  chip8.SetEngine(engine);
+  chip8.SetInstructionsPerFrame(instructionsPerFrame);
+
+  std::unique_ptr<FrameSink> sink = OpenFrameSink(target);
+  if (!sink) {
+    return false;
+  }
+
+  uint64_t changedFrames = 0;
+  bool failed = false;
+  {
+    FrameStreamWriter stream(std::move(sink));
+    for (uint32_t frame = 0; frame < frames && !stream.Failed(); ++frame) {
+      chip8.RunFrames(1);
+      if (chip8.TakeDirtyRows()) {
+        while (!stream.Submit(chip8, frame)) {
+          std::this_thread::yield();
+        }
+        ++changedFrames;
+      }
+    }
+    failed = stream.Failed();
+  }
+
+  if (failed) {
+    std::cerr << "Failed to write " << target << "\n";
+    return false;
+  }
+  std::cerr << "Streamed " << changedFrames << " of " << frames
+            << " frames, last frame hash " << std::hex
+            << FrameHash(chip8.video, chip8.HighRes()) << std::dec << "\n";
+  return true;
+}
+
+// Record 'frames' frames of the ROM played by scripted input: a random key,
+// or none, held for a random number of frames, both drawn from 'seed'
+bool RecordMovie(char const *romFilename, char const *movieFilename,
+                 QuirkProfile quirks, uint32_t seed,
+                 unsigned int instructionsPerFrame, uint32_t frames) {
+  std::vector<uint8_t> rom;
+  Chip8 chip8;
+  chip8.SetQuirks(quirks);
+  if (!ReadFile(romFilename, rom) || !chip8.LoadROM(rom.data(), rom.size())) {
+    return false;
+  }
+  chip8.Seed(seed);
+  chip8.SetInstructionsPerFrame(instructionsPerFrame);
+
+  Movie movie;
+  movie.Begin(rom, seed, instructionsPerFrame, quirks);
+
+  uint32_t input = seed | 1;
+  uint32_t hold = 0;
+  for (uint32_t frame = 0; frame < frames; ++frame) {
+    if (hold == 0) {
+      input = input * 1664525u + 1013904223u;
+      unsigned int key = (input >> 24) % (KEY_COUNT + 1);
+      for (unsigned int i = 0; i < KEY_COUNT; ++i) {
+        chip8.keypad[i] = i == key;
+      }
+      hold = 1 + (input >> 8) % 30;
+    }
+    --hold;
+
+    chip8.RunFrames(1);
+    movie.Record(chip8);
+  }
+
+  if (!movie.Save(movieFilename)) {
+    return false;
+  }
+  std::cout << "Recorded " << movie.frames << " frames, "
+            << movie.keyChanges.size() << " key changes, "
+            << movie.checkpoints.size() << " checkpoints\n";
+  return true;
+}
+
+// Replay a movie on each engine as fast as possible. Returns the number of
+// engines that diverged from the recording.
+unsigned int ReplayMovie(char const *movieFilename,
+                         const std::vector<EngineName> &engines) {
+  Movie movie;
+  if (!movie.Load(movieFilename)) {
+    std::exit(EXIT_FAILURE);
+  }
+
+  unsigned int failures = 0;
+  for (const EngineName &e : engines) {
+    uint32_t mismatchFrame = 0;
+    auto start = std::chrono::steady_clock::now();
+    bool matched = movie.Replay(e.engine, &mismatchFrame);
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    std::cout << std::left << std::setw(10) << e.name << " " << movie.frames
+              << " frames in " << std::fixed << std::setprecision(3) << seconds
+              << " s (" << std::setprecision(0)
+              << (seconds > 0 ? movie.frames / 60.0 / seconds : 0)
+              << "x real time), ";
+    std::cout.unsetf(std::ios::fixed);
+    if (matched) {
+      std::cout << movie.checkpoints.size() << " checkpoints match\n";
+    } else {
+      std::cout << "diverged by frame " << mismatchFrame << "\n";
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+} // namespace
+
+// Runs a ROM without a display for a fixed instruction budget and reports the
+// interpreter throughput, or records and replays input movies.
+int main(int argc, char **argv) {
+  std::vector<EngineName> engines;
+  QuirkProfile quirks = QuirkProfile::Modern;
+  uint32_t seed = 1; // fixed so runs, and engines, can be compared
+  unsigned int instructionsPerFrame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+  unsigned int lanes = 0;
+  char const *recordFilename = nullptr;
+  char const *replayFilename = nullptr;
+  char const *streamTarget = nullptr;
+  int arg = 1;
+
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    if (std::strncmp(argv[arg], "--engine=", 9) == 0) {
+      std::string name = argv[arg] + 9;
+      for (const EngineName &e : engineNames) {
+        if (name == "all" || name == e.name) {
+          engines.push_back(e);
+        }
+      }
+      if (engines.empty()) {
+        std::cerr << "Unknown engine: " << name << "\n";
+        std::exit(EXIT_FAILURE);
+      }
+    } else if (std::strncmp(argv[arg], "--quirks=", 9) == 0) {
+      if (!ParseQuirkProfile(argv[arg] + 9, quirks)) {
+        std::cerr << "Unknown quirk profile: " << argv[arg] + 9 << "\n";
+        std::exit(EXIT_FAILURE);
+      }
+    } else if (std::strncmp(argv[arg], "--seed=", 7) == 0) {
+      seed = std::stoul(argv[arg] + 7);
+    } else if (std::strncmp(argv[arg], "--ipf=", 6) == 0) {
+      instructionsPerFrame = std::stoul(argv[arg] + 6);
+      if (instructionsPerFrame == 0) {
+        std::cerr << "--ipf must be at least 1\n";
+        std::exit(EXIT_FAILURE);
+      }
+    } else if (std::strncmp(argv[arg], "--lanes=", 8) == 0) {
+      lanes = std::stoul(argv[arg] + 8);
+    } else if (std::strncmp(argv[arg], "--record=", 9) == 0) {
+      recordFilename = argv[arg] + 9;
+    } else if (std::strncmp(argv[arg], "--replay=", 9) == 0) {
+      replayFilename = argv[arg] + 9;
+    } else if (std::strncmp(argv[arg], "--stream=", 9) == 0) {
+      streamTarget = argv[arg] + 9;
+    } else {
+      std::cerr << "Unknown option: " << argv[arg] << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - arg != (replayFilename ? 0 : 2)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--engine=table|switch|threaded|jit|all]"
+                 " [--quirks=modern|vip|schip] [--seed=N] [--ipf=N]"
+                 " [--lanes=N] [--record=Movie] [--stream=Target]"
+                 " <Cycles> <ROM>\n"
+              << "       " << argv[0]
+              << " [--engine=table|switch|threaded|jit|all] --replay=Movie\n";
+    std::exit(EXIT_FAILURE);
+  }
+
+  if (engines.empty()) {
+    Chip8 chip8;
+    for (const EngineName &e : engineNames) {
+      if (e.engine == chip8.GetEngine()) {
+        engines.push_back(e);
+      }
+    }
+  }
+
+  if (replayFilename) {
+    return ReplayMovie(replayFilename, engines) == 0 ? EXIT_SUCCESS
+                                                     : EXIT_FAILURE;
+  }
+
+  uint64_t cycles = std::stoull(argv[arg]);
+  char const *romFilename = argv[arg + 1];
+
+  if (recordFilename) {
+    return RecordMovie(romFilename, recordFilename, quirks, seed,
+                       instructionsPerFrame, cycles / instructionsPerFrame)
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  }
+
+  if (streamTarget) {
+    return StreamFrames(romFilename, streamTarget, engines.front().engine,
+                        quirks, seed, instructionsPerFrame,
+                        cycles / instructionsPerFrame)
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  }
+
+  if (lanes > 0) {
+    return MeasureLanes(romFilename, quirks, lanes, seed,
+                        instructionsPerFrame, cycles) == 0
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  }
+
+  for (const EngineName &e : engines) {
+    uint64_t executed = 0;
+    uint64_t invalidations = 0;
+    uint64_t idleFrames = 0;
+    uint64_t changedFrames = 0;
+    uint64_t hash = 0;
+    double rate =
+        Measure(romFilename, e.engine, quirks, seed, instructionsPerFrame,
+                cycles, &executed, &invalidations, &idleFrames,
+                &changedFrames, &hash);
+
+    std::cout << std::left << std::setw(10) << e.name << " " << executed
+              << "/" << cycles << " instructions executed, " << std::fixed
+              << std::setprecision(1) << rate / 1e6 << " M instructions/s, "
+              << invalidations << " predecode cache invalidations, "
+              << idleFrames << "/" << cycles / instructionsPerFrame
+              << " frames idle, " << changedFrames << " frames changed, state "
+              << std::hex << hash << std::dec << "\n";
+    std::cout.unsetf(std::ios::fixed);
+  }
+
+  return 0;
+}
@@ -0,0 +1,362 @@
+#include "chip8.h"
+#include "host_protocol.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// A session is not stepped while this much frame data is still waiting to be
+// sent, so a client that stops reading can't make the host buffer without
+// bound
+const size_t MAX_OUTBOX = 64 * 1024;
+
+volatile std::sig_atomic_t stopRequested = 0;
+
+void RequestStop(int) { stopRequested = 1; }
+
+bool SetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// One client connection and the machine it drives. Only the host thread
+// touches a session, except during StepSessions() where exactly one worker
+// runs Step() on it while the host thread waits.
+struct Session {
+  explicit Session(int fd) : fd(fd) {}
+  ~Session() { close(fd); }
+
+  int fd;
+  std::unique_ptr<Chip8> chip8; // null until the client sends a ROM
+  uint16_t keys = 0;
+  bool keysChanged = false;
+  bool closed = false;
+  std::vector<uint8_t> inbox;
+  std::vector<uint8_t> outbox;
+
+  // Sessions without a ROM, with a backed up client, or waiting in Fx0A with
+  // both timers stopped can't change until their client does something, so
+  // the scheduler skips them entirely.
+  bool Runnable() const {
+    if (!chip8 || outbox.size() >= MAX_OUTBOX) {
+      return false;
+    }
+    return !(chip8->Idle() == IdleState::UntilKey && !keysChanged &&
+             chip8->DelayTimer() == 0 && chip8->SoundTimer() == 0);
+  }
+
+  // Run one 60 Hz frame and queue the rows it changed. Called on a worker.
+  void Step() {
+    for (unsigned int i = 0; i < KEY_COUNT; ++i) {
+      chip8->keypad[i] = (keys >> i) & 1;
+    }
+    keysChanged = false;
+
+    chip8->RunFrames(1);
+
+    uint64_t rows = chip8->TakeDirtyRows();
+    if (rows == 0) {
+      return;
+    }
+
+    uint16_t size[2] = {static_cast<uint16_t>(chip8->Width()),
+                        static_cast<uint16_t>(chip8->Height())};
+    size_t rowBytes = chip8->RowWords() * sizeof(chip8->video[0]);
+
+    MessageHeader header{MSG_FRAME, 0, 0};
+    header.length = sizeof(size) + sizeof(rows) +
+                    __builtin_popcountll(rows) * rowBytes;
+
+    Append(&header, sizeof(header));
+    Append(size, sizeof(size));
+    Append(&rows, sizeof(rows));
+    for (uint64_t pending = rows; pending != 0; pending &= pending - 1) {
+      unsigned int y = __builtin_ctzll(pending);
+      Append(&chip8->video[y * chip8->RowWords()], rowBytes);
+    }
+  }
+
+  void Append(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    outbox.insert(outbox.end(), bytes, bytes + size);
+  }
+};
+
+class Host {
+public:
+  Host(int listenFd, unsigned int threads, unsigned int instructionsPerFrame)
+      : listenFd(listenFd), pool(threads),
+        instructionsPerFrame(instructionsPerFrame) {}
+
+  void Run();
+
+private:
+  int listenFd;
+  ThreadPool pool;
+  unsigned int instructionsPerFrame;
+  std::vector<std::unique_ptr<Session>> sessions;
+  std::vector<pollfd> pollFds;
+
+  void Accept();
+  void Receive(Session &session);
+  void Send(Session &session);
+  bool HandleMessage(Session &session, const MessageHeader &header,
+                     const uint8_t *payload);
+  void StepSessions();
+};
+
+void Host::Run() {
+  const std::chrono::steady_clock::duration frameTime =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / 60.0));
+  auto nextFrame = std::chrono::steady_clock::now();
+
+  while (!stopRequested) {
+    pollFds.clear();
+    pollFds.push_back(pollfd{listenFd, POLLIN, 0});
+    for (const std::unique_ptr<Session> &session : sessions) {
+      short events = POLLIN;
+      if (!session->outbox.empty()) {
+        events |= POLLOUT;
+      }
+      pollFds.push_back(pollfd{session->fd, events, 0});
+    }
+
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        nextFrame - std::chrono::steady_clock::now());
+    int timeout = std::max<int>(0, wait.count() + 1);
+
+    int ready = poll(pollFds.data(), pollFds.size(), timeout);
+    if (ready < 0 && errno != EINTR) {
+      std::perror("poll");
+      return;
+    }
+
+    if (ready > 0) {
+      for (size_t i = 0; i < sessions.size(); ++i) {
+        short revents = pollFds[i + 1].revents;
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+          Receive(*sessions[i]);
+        }
+        if ((revents & POLLOUT) && !sessions[i]->closed) {
+          Send(*sessions[i]);
+        }
+      }
+      if (pollFds[0].revents & POLLIN) {
+        Accept();
+      }
+    }
+
+    if (std::chrono::steady_clock::now() >= nextFrame) {
+      StepSessions();
+
+      // Don't try to catch up after a long stall
+      nextFrame += frameTime;
+      auto now = std::chrono::steady_clock::now();
+      if (nextFrame < now) {
+        nextFrame = now;
+      }
+    }
+
+    sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
+                                  [](const std::unique_ptr<Session> &s) {
+                                    return s->closed;
+                                  }),
+                   sessions.end());
+  }
+}
+
+void Host::Accept() {
+  for (;;) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        std::perror("accept");
+      }
+      return;
+    }
+    if (!SetNonBlocking(fd)) {
+      close(fd);
+      continue;
+    }
+    sessions.emplace_back(new Session(fd));
+  }
+}
+
+void Host::Receive(Session &session) {
+  uint8_t buffer[4096];
+  for (;;) {
+    ssize_t received = recv(session.fd, buffer, sizeof(buffer), 0);
+    if (received == 0) {
+      session.closed = true;
+      return;
+    }
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        session.closed = true;
+        return;
+      }
+      break;
+    }
+    session.inbox.insert(session.inbox.end(), buffer, buffer + received);
+  }
+
+  // Handle every complete message, keep any partial one for later
+  size_t offset = 0;
+  while (session.inbox.size() - offset >= sizeof(MessageHeader)) {
+    MessageHeader header;
+    std::memcpy(&header, session.inbox.data() + offset, sizeof(header));
+    if (session.inbox.size() - offset < sizeof(header) + header.length) {
+      break;
+    }
+    if (!HandleMessage(session, header,
+                       session.inbox.data() + offset + sizeof(header))) {
+      session.closed = true;
+      return;
+    }
+    offset += sizeof(header) + header.length;
+  }
+  session.inbox.erase(session.inbox.begin(), session.inbox.begin() + offset);
+
+  // Nothing valid is longer than a ROM
+  if (session.inbox.size() > sizeof(MessageHeader) + MEMORY_SIZE) {
+    session.closed = true;
+  }
+}
+
+bool Host::HandleMessage(Session &session, const MessageHeader &header,
+                         const uint8_t *payload) {
+  switch (header.type) {
+  case MSG_LOAD_ROM:
+    session.chip8.reset(new Chip8);
+    session.chip8->SetInstructionsPerFrame(instructionsPerFrame);
+    session.keysChanged = true;
+    return session.chip8->LoadROM(payload, header.length);
+
+  case MSG_KEYS:
+    if (header.length != sizeof(session.keys)) {
+      return false;
+    }
+    uint16_t keys;
+    std::memcpy(&keys, payload, sizeof(keys));
+    session.keysChanged = session.keysChanged || keys != session.keys;
+    session.keys = keys;
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+void Host::Send(Session &session) {
+  size_t sent = 0;
+  while (sent < session.outbox.size()) {
+    ssize_t n = send(session.fd, session.outbox.data() + sent,
+                     session.outbox.size() - sent, 0);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        session.closed = true;
+      }
+      break;
+    }
+    sent += n;
+  }
+  session.outbox.erase(session.outbox.begin(), session.outbox.begin() + sent);
+}
+
+void Host::StepSessions() {
+  for (const std::unique_ptr<Session> &session : sessions) {
+    if (!session->closed && session->Runnable()) {
+      Session *s = session.get();
+      pool.Submit([s] { s->Step(); });
+    }
+  }
+  pool.Wait();
+
+  for (const std::unique_ptr<Session> &session : sessions) {
+    if (!session->closed && !session->outbox.empty()) {
+      Send(*session);
+    }
+  }
+}
+
+} // namespace
+
+// Hosts many CHIP-8 sessions in one process. Each client connects to the
+// Unix domain socket, sends a ROM and keypad changes, and receives the rows
+// of every frame that changed (see host_protocol.h).
+int main(int argc, char **argv) {
+  unsigned int threads = std::thread::hardware_concurrency();
+  unsigned int instructionsPerFrame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+  int arg = 1;
+
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    if (std::strncmp(argv[arg], "--threads=", 10) == 0) {
+      threads = std::stoul(argv[arg] + 10);
+    } else if (std::strncmp(argv[arg], "--ipf=", 6) == 0) {
+      instructionsPerFrame = std::stoul(argv[arg] + 6);
+      if (instructionsPerFrame == 0) {
+        std::cerr << "--ipf must be at least 1\n";
+        std::exit(EXIT_FAILURE);
+      }
+    } else {
+      std::cerr << "Unknown option: " << argv[arg] << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - arg != 1) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--threads=N] [--ipf=N] <SocketPath>\n";
+    std::exit(EXIT_FAILURE);
+  }
+
+  char const *socketPath = argv[arg];
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (std::strlen(socketPath) >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long: " << socketPath << "\n";
+    std::exit(EXIT_FAILURE);
+  }
+  std::strcpy(address.sun_path, socketPath);
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketPath);
+  if (listenFd < 0 ||
+      bind(listenFd, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) != 0 ||
+      listen(listenFd, SOMAXCONN) != 0 || !SetNonBlocking(listenFd)) {
+    std::perror(socketPath);
+    std::exit(EXIT_FAILURE);
+  }
+
+  std::signal(SIGPIPE, SIG_IGN);
+  std::signal(SIGINT, RequestStop);
+  std::signal(SIGTERM, RequestStop);
+
+  {
+    Host host(listenFd, threads, instructionsPerFrame);
+    std::cout << "Listening on " << socketPath << " with "
+              << std::max(threads, 1u) << " worker threads\n";
+    host.Run();
+  }
+
+  close(listenFd);
+  unlink(socketPath);
+  return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+
+// Messages exchanged with chip8-host over its Unix domain socket. Every
+// message is a MessageHeader followed by 'length' bytes of payload. Both ends
+// run on the same machine, so all integers are in host byte order.
+struct MessageHeader {
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t length;
+};
+
+static_assert(sizeof(MessageHeader) == 4, "MessageHeader is sent as is");
+
+enum MessageType : uint8_t {
+  // Client to host: the ROM image. Starts, or restarts, the session.
+  MSG_LOAD_ROM = 1,
+
+  // Client to host: uint16_t keypad state, bit n set while key n is down
+  MSG_KEYS = 2,
+
+  // Host to client: uint16_t width and height of the display (64x32, or
+  // 128x64 in SUPER-CHIP high resolution), a uint64_t mask of the rows that
+  // changed since the last frame sent, then width / 64 uint64_t words for
+  // each set bit, lowest row first. Bit 63 of a word is its leftmost pixel.
+  // Every row is sent after a resolution change.
+  MSG_FRAME = 3,
+};
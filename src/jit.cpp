@@ -0,0 +1,432 @@
+#include "jit.h"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+// Executable memory reserved per machine
+const size_t CODE_BUFFER_SIZE = 1 << 20;
+
+// Longest run of instructions translated into one block
+const unsigned int MAX_BLOCK_INSTRUCTIONS = 64;
+
+// Upper bound on the native code emitted for one block
+const size_t MAX_BLOCK_CODE = MAX_BLOCK_INSTRUCTIONS * 48;
+
+// Registers used in ModRM reg fields
+const uint8_t EAX = 0;
+const uint8_t ECX = 1;
+
+// Length of the "mov word [rdi + disp32], imm16" emitted by EmitSetPc
+const uint8_t SET_PC_LENGTH = 9;
+
+} // namespace
+
+Jit::Jit(Chip8 &chip8) : chip8(chip8) {
+  uint8_t *base = chip8.registers;
+  offIndex = reinterpret_cast<uint8_t *>(&chip8.index) - base;
+  offPc = reinterpret_cast<uint8_t *>(&chip8.pc) - base;
+  offSp = reinterpret_cast<uint8_t *>(&chip8.sp) - base;
+  offStack = reinterpret_cast<uint8_t *>(chip8.stack) - base;
+  offKeypad = reinterpret_cast<uint8_t *>(chip8.keypad) - base;
+  offDelayTimer = reinterpret_cast<uint8_t *>(&chip8.delayTimer) - base;
+  offSoundTimer = reinterpret_cast<uint8_t *>(&chip8.soundTimer) - base;
+
+#if defined(__x86_64__)
+  void *mem = mmap(nullptr, CODE_BUFFER_SIZE,
+                   PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem != MAP_FAILED) {
+    codeBuffer = static_cast<uint8_t *>(mem);
+    codeSize = CODE_BUFFER_SIZE;
+  }
+#endif
+}
+
+Jit::~Jit() {
+#if defined(__x86_64__)
+  if (codeBuffer) {
+    munmap(codeBuffer, codeSize);
+  }
+#endif
+}
+
+void Jit::Flush() {
+  std::memset(blocks, 0, sizeof(blocks));
+  std::memset(covered, 0, sizeof(covered));
+  codeUsed = 0;
+  ++flushes;
+}
+
+void Jit::Emit16(uint16_t value) {
+  Emit(value & 0xFFu);
+  Emit(value >> 8);
+}
+
+void Jit::Emit32(int32_t value) {
+  uint32_t v = static_cast<uint32_t>(value);
+  for (int i = 0; i < 4; ++i) {
+    Emit((v >> (8 * i)) & 0xFFu);
+  }
+}
+
+// ModRM for [rdi + disp32] with 'reg' in the reg field
+void Jit::EmitModRM(uint8_t reg, int32_t disp) {
+  Emit(0x87 | (reg << 3));
+  Emit32(disp);
+}
+
+// mov word [pc], value
+void Jit::EmitSetPc(uint16_t value) {
+  Emit(0x66);
+  Emit(0xC7);
+  EmitModRM(0, offPc);
+  Emit16(value);
+}
+
+void Jit::Translate(uint16_t address) {
+  JitBlock &block = blocks[address];
+  block.translated = true;
+
+  if (!codeBuffer) {
+    return;
+  }
+
+  if (codeSize - codeUsed < MAX_BLOCK_CODE) {
+    Flush();
+    block.translated = true;
+  }
+
+  uint8_t *start = codeBuffer + codeUsed;
+  out = start;
+
+  uint16_t pc = address;
+  uint16_t count = 0;
+  bool ends = false;
+
+  while (!ends && count < MAX_BLOCK_INSTRUCTIONS &&
+         pc + 1u < MEMORY_SIZE) {
+    uint16_t opcode = (chip8.memory[pc] << 8) | chip8.memory[pc + 1];
+    if (!TranslateOne(pc, opcode, ends)) {
+      break;
+    }
+    pc += 2;
+    ++count;
+  }
+
+  if (count == 0) {
+    // First instruction is not translated, leave it to the interpreter
+    return;
+  }
+
+  if (!ends) {
+    // Fell off the end of the block: continue at the next instruction
+    EmitSetPc(pc);
+    Emit(0xC3); // ret
+  } else {
+    // Backward jumps get the same idle loop check as OP_1nnn
+    uint16_t last = pc - 2;
+    uint16_t opcode = (chip8.memory[last] << 8) | chip8.memory[last + 1];
+    if ((opcode >> 12) == 0x1 && (opcode & 0x0FFFu) <= last) {
+      block.loopJump = last;
+      block.loopCheck = true;
+    }
+  }
+
+  for (uint16_t a = address; a < pc; ++a) {
+    covered[a] = true;
+  }
+
+  codeUsed += out - start;
+  block.code = reinterpret_cast<void (*)(uint8_t *)>(start);
+  block.count = count;
+}
+
+// Translate the instruction at 'address'. Returns false when the instruction
+// is left to the interpreter. Sets 'ends' for control flow instructions,
+// which write pc and return.
+bool Jit::TranslateOne(uint16_t address, uint16_t opcode, bool &ends) {
+  uint8_t x = (opcode & 0x0F00u) >> 8;
+  uint8_t y = (opcode & 0x00F0u) >> 4;
+  uint8_t kk = opcode & 0x00FFu;
+  uint16_t nnn = opcode & 0x0FFFu;
+  uint16_t next = address + 2;
+
+  // The quirks are fixed for the life of a translation, see SetQuirks()
+  QuirkFlags quirks = GetQuirkFlags(chip8.quirks);
+  uint8_t shifted = quirks.shiftUsesVy ? y : x;
+
+  switch (opcode >> 12) {
+  case 0x0:
+    if (opcode != 0x00EE) {
+      return false;
+    }
+    // RET
+    Emit(0xFE); // dec byte [sp]
+    EmitModRM(1, offSp);
+    Emit(0x0F); // movzx eax, byte [sp]
+    Emit(0xB6);
+    EmitModRM(EAX, offSp);
+    Emit(0x0F); // movzx eax, word [rdi + rax*2 + stack]
+    Emit(0xB7);
+    Emit(0x84);
+    Emit(0x47);
+    Emit32(offStack);
+    Emit(0x66); // mov word [pc], ax
+    Emit(0x89);
+    EmitModRM(EAX, offPc);
+    Emit(0xC3);
+    ends = true;
+    return true;
+
+  case 0x1:
+    // JP addr
+    EmitSetPc(nnn);
+    Emit(0xC3);
+    ends = true;
+    return true;
+
+  case 0x2:
+    // CALL addr
+    Emit(0x0F); // movzx eax, byte [sp]
+    Emit(0xB6);
+    EmitModRM(EAX, offSp);
+    Emit(0x66); // mov word [rdi + rax*2 + stack], next
+    Emit(0xC7);
+    Emit(0x84);
+    Emit(0x47);
+    Emit32(offStack);
+    Emit16(next);
+    Emit(0xFE); // inc byte [sp]
+    EmitModRM(0, offSp);
+    EmitSetPc(nnn);
+    Emit(0xC3);
+    ends = true;
+    return true;
+
+  case 0x3:
+  case 0x4:
+    // SE/SNE Vx, byte
+    EmitSetPc(next);
+    Emit(0x80); // cmp byte [Vx], kk
+    EmitModRM(7, x);
+    Emit(kk);
+    Emit((opcode >> 12) == 0x3 ? 0x75 : 0x74); // jne/je over the skip
+    Emit(SET_PC_LENGTH);
+    EmitSetPc(next + 2);
+    Emit(0xC3);
+    ends = true;
+    return true;
+
+  case 0x5:
+  case 0x9:
+    // SE/SNE Vx, Vy
+    Emit(0x8A); // mov al, [Vx]
+    EmitModRM(EAX, x);
+    Emit(0x3A); // cmp al, [Vy]
+    EmitModRM(EAX, y);
+    EmitSetPc(next);
+    Emit((opcode >> 12) == 0x5 ? 0x75 : 0x74);
+    Emit(SET_PC_LENGTH);
+    EmitSetPc(next + 2);
+    Emit(0xC3);
+    ends = true;
+    return true;
+
+  case 0x6:
+    // LD Vx, byte
+    Emit(0xC6);
+    EmitModRM(0, x);
+    Emit(kk);
+    return true;
+
+  case 0x7:
+    // ADD Vx, byte
+    Emit(0x80);
+    EmitModRM(0, x);
+    Emit(kk);
+    return true;
+
+  case 0x8:
+    switch (opcode & 0x000Fu) {
+    case 0x0:
+    case 0x1:
+    case 0x2:
+    case 0x3: {
+      // LD/OR/AND/XOR Vx, Vy
+      static const uint8_t ops[4] = {0x88, 0x08, 0x20, 0x30};
+      Emit(0x8A); // mov al, [Vy]
+      EmitModRM(EAX, y);
+      Emit(ops[opcode & 0x000Fu]); // op [Vx], al
+      EmitModRM(EAX, x);
+      return true;
+    }
+    case 0x4:
+      // ADD Vx, Vy: Vx = low byte of the sum, then VF = carry
+      Emit(0x0F); // movzx eax, byte [Vx]
+      Emit(0xB6);
+      EmitModRM(EAX, x);
+      Emit(0x0F); // movzx ecx, byte [Vy]
+      Emit(0xB6);
+      EmitModRM(ECX, y);
+      Emit(0x01); // add eax, ecx
+      Emit(0xC8);
+      Emit(0x88); // mov [Vx], al
+      EmitModRM(EAX, x);
+      Emit(0xC1); // shr eax, 8
+      Emit(0xE8);
+      Emit(8);
+      Emit(0x88); // mov [VF], al
+      EmitModRM(EAX, 0xF);
+      return true;
+    case 0x5:
+    case 0x7: {
+      // SUB Vx, Vy / SUBN Vx, Vy: VF = NOT borrow is written first, then the
+      // difference is computed from the (possibly updated) registers.
+      uint8_t a = (opcode & 0x000Fu) == 0x5 ? x : y;
+      uint8_t b = (opcode & 0x000Fu) == 0x5 ? y : x;
+      Emit(0x8A); // mov al, [a]
+      EmitModRM(EAX, a);
+      Emit(0x3A); // cmp al, [b]
+      EmitModRM(EAX, b);
+      Emit(0x0F); // setae al
+      Emit(0x93);
+      Emit(0xC0);
+      Emit(0x88); // mov [VF], al
+      EmitModRM(EAX, 0xF);
+      Emit(0x8A); // mov al, [a]
+      EmitModRM(EAX, a);
+      Emit(0x2A); // sub al, [b]
+      EmitModRM(EAX, b);
+      Emit(0x88); // mov [Vx], al
+      EmitModRM(EAX, x);
+      return true;
+    }
+    case 0x6:
+      // SHR Vx {, Vy}: VF first, then the source is read again
+      Emit(0x8A); // mov al, [source]
+      EmitModRM(EAX, shifted);
+      Emit(0x24); // and al, 1
+      Emit(1);
+      Emit(0x88); // mov [VF], al
+      EmitModRM(EAX, 0xF);
+      Emit(0x8A); // mov al, [source]
+      EmitModRM(EAX, shifted);
+      Emit(0xD0); // shr al, 1
+      Emit(0xE8);
+      Emit(0x88); // mov [Vx], al
+      EmitModRM(EAX, x);
+      return true;
+    case 0xE:
+      // SHL Vx {, Vy}
+      Emit(0x8A); // mov al, [source]
+      EmitModRM(EAX, shifted);
+      Emit(0xC0); // shr al, 7
+      Emit(0xE8);
+      Emit(7);
+      Emit(0x88); // mov [VF], al
+      EmitModRM(EAX, 0xF);
+      Emit(0x8A); // mov al, [source]
+      EmitModRM(EAX, shifted);
+      Emit(0xD0); // shl al, 1
+      Emit(0xE0);
+      Emit(0x88); // mov [Vx], al
+      EmitModRM(EAX, x);
+      return true;
+    default:
+      return false;
+    }
+
+  case 0xA:
+    // LD I, addr
+    Emit(0x66);
+    Emit(0xC7);
+    EmitModRM(0, offIndex);
+    Emit16(nnn);
+    return true;
+
+  case 0xB:
+    // JP V0, addr (Vx with the jump quirk)
+    Emit(0x0F); // movzx eax, byte [V0 or Vx]
+    Emit(0xB6);
+    EmitModRM(EAX, quirks.jumpUsesVx ? x : 0);
+    Emit(0x05); // add eax, nnn
+    Emit32(nnn);
+    Emit(0x66); // mov word [pc], ax
+    Emit(0x89);
+    EmitModRM(EAX, offPc);
+    Emit(0xC3);
+    ends = true;
+    return true;
+
+  case 0xE:
+    // SKP Vx / SKNP Vx
+    if (kk != 0x9E && kk != 0xA1) {
+      return false;
+    }
+    Emit(0x0F); // movzx eax, byte [Vx]
+    Emit(0xB6);
+    EmitModRM(EAX, x);
+    EmitSetPc(next);
+    Emit(0x80); // cmp byte [rdi + rax + keypad], 0
+    Emit(0xBC);
+    Emit(0x07);
+    Emit32(offKeypad);
+    Emit(0);
+    Emit(kk == 0x9E ? 0x74 : 0x75); // je/jne over the skip
+    Emit(SET_PC_LENGTH);
+    EmitSetPc(next + 2);
+    Emit(0xC3);
+    ends = true;
+    return true;
+
+  case 0xF:
+    switch (kk) {
+    case 0x07:
+      // LD Vx, DT. The timers only change between frames, never inside Run()
+      Emit(0x8A); // mov al, [DT]
+      EmitModRM(EAX, offDelayTimer);
+      Emit(0x88); // mov [Vx], al
+      EmitModRM(EAX, x);
+      return true;
+    case 0x15:
+    case 0x18:
+      // LD DT, Vx / LD ST, Vx
+      Emit(0x8A); // mov al, [Vx]
+      EmitModRM(EAX, x);
+      Emit(0x88); // mov [DT or ST], al
+      EmitModRM(EAX, kk == 0x15 ? offDelayTimer : offSoundTimer);
+      return true;
+    case 0x1E:
+      // ADD I, Vx
+      Emit(0x0F); // movzx eax, byte [Vx]
+      Emit(0xB6);
+      EmitModRM(EAX, x);
+      Emit(0x66); // add word [I], ax
+      Emit(0x01);
+      EmitModRM(EAX, offIndex);
+      return true;
+    case 0x29:
+      // LD F, Vx
+      Emit(0x0F); // movzx eax, byte [Vx]
+      Emit(0xB6);
+      EmitModRM(EAX, x);
+      Emit(0x8D); // lea eax, [rax + rax*4 + fontset]
+      Emit(0x44);
+      Emit(0x80);
+      Emit(FONTSET_START_ADDRESS);
+      Emit(0x66); // mov word [I], ax
+      Emit(0x89);
+      EmitModRM(EAX, offIndex);
+      return true;
+    default:
+      return false;
+    }
+
+  default:
+    return false;
+  }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "chip8.h"
+#include <cstddef>
+#include <cstdint>
+
+// A translated run of straight-line CHIP-8 instructions. 'code' is native
+// x86-64 code taking a pointer to the machine's registers; it executes all
+// 'count' instructions and leaves pc pointing at the next one to run.
+struct JitBlock {
+  void (*code)(uint8_t *registers);
+  uint16_t count;
+  uint16_t loopJump; // address of the final 1nnn when it jumps backwards
+  bool loopCheck;    // the block ends with such a jump
+  bool translated;   // false until the JIT has looked at this address
+};
+
+// Basic-block JIT for x86-64. Blocks end at 1nnn/2nnn/00EE/Bnnn and the skip
+// instructions, or before the first instruction the JIT does not translate
+// (Dxyn, Fx0A, Cxkk, memory writes, ...), which the interpreter then runs.
+// On other architectures, or when executable memory is not available,
+// Available() is false and Chip8 falls back to the interpreter.
+class Jit {
+public:
+  explicit Jit(Chip8 &chip8);
+  ~Jit();
+
+  bool Available() const { return codeBuffer != nullptr; }
+
+  // Block starting at 'address', translating it on first use. Returns nullptr
+  // when the instruction at 'address' has to be interpreted.
+  const JitBlock *Get(uint16_t address) {
+    JitBlock &block = blocks[address];
+    if (!block.translated) {
+      Translate(address);
+    }
+    return block.code ? &block : nullptr;
+  }
+
+  // Called for every byte the program writes to memory
+  void Invalidate(uint16_t address) {
+    if (covered[address]) {
+      Flush();
+    }
+  }
+
+  // Drop every translated block
+  void Flush();
+
+  uint64_t Flushes() const { return flushes; }
+
+private:
+  Chip8 &chip8;
+
+  // Byte offsets of the machine fields from chip8.registers
+  int32_t offIndex;
+  int32_t offPc;
+  int32_t offSp;
+  int32_t offStack;
+  int32_t offKeypad;
+  int32_t offDelayTimer;
+  int32_t offSoundTimer;
+
+  uint8_t *codeBuffer{};
+  size_t codeSize{};
+  size_t codeUsed{};
+  uint8_t *out{}; // write cursor while translating
+
+  JitBlock blocks[MEMORY_SIZE]{};
+  bool covered[MEMORY_SIZE]{}; // bytes that belong to a translated block
+  uint64_t flushes{};
+
+  void Translate(uint16_t address);
+  bool TranslateOne(uint16_t address, uint16_t opcode, bool &ends);
+
+  // x86-64 encoding helpers, all addressing [rdi + disp32]
+  void Emit(uint8_t byte) { *out++ = byte; }
+  void Emit16(uint16_t value);
+  void Emit32(int32_t value);
+  void EmitModRM(uint8_t reg, int32_t disp);
+  void EmitSetPc(uint16_t value);
+};
@@ -0,0 +1,523 @@
+#include "lanes.h"
+#include <cstring>
+
+namespace {
+
+// Pick 'value' in the lanes whose mask is all ones, keep 'old' elsewhere.
+// Written without branches so the loops over lanes vectorize.
+inline uint8_t Blend(uint8_t mask, uint8_t value, uint8_t old) {
+  return (value & mask) | (old & ~mask);
+}
+
+inline uint16_t Blend16(uint16_t mask, uint16_t value, uint16_t old) {
+  return (value & mask) | (old & ~mask);
+}
+
+const uint32_t NO_LANE = 0x10000; // above every pc
+
+} // namespace
+
+Chip8Lanes::Chip8Lanes(const Chip8 &machine, unsigned int lanes)
+    : count(lanes), instructionsPerFrame(machine.InstructionsPerFrame()),
+      quirks(GetQuirkFlags(machine.GetQuirks())),
+      machines(new Chip8[lanes]), codePages(lanes), registers(16 * lanes),
+      index(lanes), pc(lanes), delayTimer(lanes), soundTimer(lanes),
+      budget(lanes), idle(lanes), sp(lanes), sideEffects(lanes),
+      loopTaken(lanes), loopSideEffects(lanes), loopJump(lanes),
+      loopIndex(lanes), loopSp(lanes), loopDelayTimer(lanes),
+      loopSoundTimer(lanes), loopRegisters(16 * lanes), active(lanes),
+      active16(lanes), matched(lanes) {
+  Chip8State state;
+  machine.SaveState(state);
+
+  for (unsigned int i = 0; i < count; ++i) {
+    Chip8 &lane = machines[i];
+    lane.LoadState(state);
+    lane.TakeDirtyPages();
+
+    // The lanes step their Chip8s one instruction at a time and do their own
+    // idle loop detection, which needs the plain interpreter
+    lane.SetEngine(Engine::Table);
+    lane.SetQuirks(machine.GetQuirks());
+
+    Load(i);
+  }
+}
+
+void Chip8Lanes::SetKeys(unsigned int lane, uint16_t keys) {
+  for (unsigned int k = 0; k < KEY_COUNT; ++k) {
+    machines[lane].keypad[k] = (keys >> k) & 1;
+  }
+}
+
+Chip8 &Chip8Lanes::Lane(unsigned int lane) {
+  Store(lane);
+
+  Chip8 &machine = machines[lane];
+  machine.idle = static_cast<IdleState>(idle[lane]);
+  machine.loop.frame = ~0ull;
+  return machine;
+}
+
+void Chip8Lanes::Store(unsigned int lane) {
+  Chip8 &machine = machines[lane];
+  for (unsigned int r = 0; r < 16; ++r) {
+    machine.registers[r] = registers[r * count + lane];
+  }
+  machine.index = index[lane];
+  machine.pc = pc[lane];
+  machine.delayTimer = delayTimer[lane];
+  machine.soundTimer = soundTimer[lane];
+}
+
+void Chip8Lanes::Load(unsigned int lane) {
+  Chip8 &machine = machines[lane];
+  for (unsigned int r = 0; r < 16; ++r) {
+    registers[r * count + lane] = machine.registers[r];
+  }
+  index[lane] = machine.index;
+  pc[lane] = machine.pc;
+  delayTimer[lane] = machine.delayTimer;
+  soundTimer[lane] = machine.soundTimer;
+  sp[lane] = machine.sp;
+  sideEffects[lane] = static_cast<uint32_t>(machine.sideEffects);
+
+  // Recheck the pages the lane wrote against lane 0's. When lane 0 itself
+  // wrote, every other lane has to be compared again.
+  for (uint64_t pages = machine.TakeDirtyPages(); pages != 0;
+       pages &= pages - 1) {
+    unsigned int page = __builtin_ctzll(pages);
+    unsigned int first = lane == 0 ? 1 : lane;
+    unsigned int last = lane == 0 ? count : lane + 1;
+    for (unsigned int i = first; i < last; ++i) {
+      ComparePage(i, page);
+    }
+  }
+}
+
+void Chip8Lanes::ComparePage(unsigned int lane, unsigned int page) {
+  unsigned int start = page * MEMORY_PAGE_SIZE;
+  uint64_t before = codePages[lane];
+  if (std::memcmp(machines[lane].memory + start, machines[0].memory + start,
+                  MEMORY_PAGE_SIZE) != 0) {
+    codePages[lane] |= 1ull << page;
+  } else {
+    codePages[lane] &= ~(1ull << page);
+  }
+  divergedLanes += (codePages[lane] != 0) - (before != 0);
+}
+
+uint16_t Chip8Lanes::Opcode(unsigned int lane, uint16_t address) const {
+  const uint8_t *memory = machines[lane].memory;
+  return (memory[address & (MEMORY_SIZE - 1)] << 8) |
+         memory[(address + 1) & (MEMORY_SIZE - 1)];
+}
+
+void Chip8Lanes::RunFrames(unsigned int frames) {
+  for (unsigned int f = 0; f < frames; ++f) {
+    for (unsigned int i = 0; i < count; ++i) {
+      bool run = idle[i] != static_cast<uint8_t>(IdleState::UntilKey) ||
+                 machines[i].AnyKeyDown();
+      budget[i] = run ? instructionsPerFrame : 0;
+      if (run) {
+        idle[i] = static_cast<uint8_t>(IdleState::Running);
+      }
+      loopTaken[i] = 0;
+    }
+
+    RunBudget();
+
+    for (unsigned int i = 0; i < count; ++i) {
+      if (idle[i] != static_cast<uint8_t>(IdleState::Running)) {
+        ++machines[i].idleFrames;
+      }
+      ++machines[i].frameCount;
+    }
+
+    uint8_t *delays = delayTimer.data();
+    uint8_t *sounds = soundTimer.data();
+    for (unsigned int i = 0; i < count; ++i) {
+      delays[i] -= delays[i] != 0;
+      sounds[i] -= sounds[i] != 0;
+    }
+  }
+}
+
+// Step the lanes until every budget is spent
+void Chip8Lanes::RunBudget() {
+  std::vector<unsigned int> diverged;
+  std::vector<unsigned int> remaining;
+
+  for (;;) {
+    const uint16_t *pcs = pc.data();
+    uint32_t *budgets = budget.data();
+    const uint64_t *pages = codePages.data();
+    uint8_t *m = active.data();
+    uint16_t *m16 = active16.data();
+    const unsigned int n = count;
+
+    uint32_t next = NO_LANE;
+    for (unsigned int i = 0; i < n; ++i) {
+      uint32_t key = pcs[i] | (static_cast<uint32_t>(budgets[i] == 0) << 16);
+      next = key < next ? key : next;
+    }
+    if (next == NO_LANE) {
+      return;
+    }
+
+    uint16_t address = next;
+    uint64_t codeMask =
+        (1ull << ((address & (MEMORY_SIZE - 1)) / MEMORY_PAGE_SIZE)) |
+        (1ull << (((address + 1) & (MEMORY_SIZE - 1)) / MEMORY_PAGE_SIZE));
+
+    // Lanes at this pc whose code matches lane 0's run together
+    uint8_t anyDiverged = 0;
+    if (divergedLanes == 0) {
+      for (unsigned int i = 0; i < n; ++i) {
+        m[i] = -static_cast<uint8_t>((budgets[i] != 0) & (pcs[i] == address));
+        m16[i] = -static_cast<uint16_t>(m[i] & 1);
+        budgets[i] -= m[i] & 1;
+      }
+    } else {
+      for (unsigned int i = 0; i < n; ++i) {
+        uint8_t here = -static_cast<uint8_t>((budgets[i] != 0) &
+                                             (pcs[i] == address));
+        uint8_t shared = -static_cast<uint8_t>((pages[i] & codeMask) == 0);
+        m[i] = here & shared;
+        m16[i] = -static_cast<uint16_t>(m[i] & 1);
+        budgets[i] -= m[i] & 1;
+        anyDiverged |= here & ~shared;
+      }
+    }
+
+    diverged.clear();
+    if (anyDiverged) {
+      for (unsigned int i = 0; i < count; ++i) {
+        if (budget[i] != 0 && pc[i] == address && (codePages[i] & codeMask)) {
+          diverged.push_back(i);
+        }
+      }
+    }
+
+    Execute(address, Opcode(0, address));
+
+    // The rest run in groups of lanes holding the same instruction
+    while (!diverged.empty()) {
+      uint16_t opcode = Opcode(diverged[0], address);
+      std::memset(active.data(), 0, count * sizeof(active[0]));
+      std::memset(active16.data(), 0, count * sizeof(active16[0]));
+
+      remaining.clear();
+      for (unsigned int lane : diverged) {
+        if (Opcode(lane, address) == opcode) {
+          SetActive(lane);
+          --budget[lane];
+        } else {
+          remaining.push_back(lane);
+        }
+      }
+
+      Execute(address, opcode);
+      diverged.swap(remaining);
+    }
+  }
+}
+
+// Run 'opcode' at 'address' on the active lanes
+void Chip8Lanes::Execute(uint16_t address, uint16_t opcode) {
+  const uint8_t *m = active.data();
+  unsigned int lanes = 0;
+  for (unsigned int i = 0; i < count; ++i) {
+    lanes += m[i] & 1;
+  }
+
+  if (ExecuteLockstep(address, opcode)) {
+    lockstepInstructions += lanes;
+    return;
+  }
+
+  for (unsigned int i = 0; i < count; ++i) {
+    if (active[i]) {
+      ExecuteScalar(i);
+    }
+  }
+  scalarInstructions += lanes;
+}
+
+// The instructions that only touch lockstep state, on all active lanes at
+// once. Each lane reads and writes its registers in the same order as the
+// matching OP_* handler, so e.g. x or y being F behaves the same. Returns
+// false for instructions that have to run through the lanes' Chip8s.
+bool Chip8Lanes::ExecuteLockstep(uint16_t address, uint16_t opcode) {
+  const uint8_t *m = active.data();
+  const uint16_t *m16 = active16.data();
+  const unsigned int n = count;
+  uint16_t *pcs = pc.data();
+  uint16_t *indexes = index.data();
+  uint8_t *delays = delayTimer.data();
+  uint8_t *sounds = soundTimer.data();
+
+  uint8_t *vx = Register((opcode >> 8) & 0xF);
+  uint8_t *vy = Register((opcode >> 4) & 0xF);
+  uint8_t *vf = Register(0xF);
+  uint8_t *v0 = Register(0);
+  uint8_t *shifted = quirks.shiftUsesVy ? vy : vx;
+  uint8_t *offset = quirks.jumpUsesVx ? vx : v0;
+  uint8_t kk = opcode & 0xFF;
+  uint16_t nnn = opcode & 0xFFF;
+  uint16_t next = address + 2;
+  uint16_t skip = address + 4;
+
+  switch (opcode >> 12) {
+  case 0x1:
+    for (unsigned int i = 0; i < n; ++i) {
+      pcs[i] = Blend16(m16[i], nnn, pcs[i]);
+    }
+    if (nnn <= address) {
+      CheckIdleLoops(address);
+    }
+    return true;
+
+  case 0x3:
+    for (unsigned int i = 0; i < n; ++i) {
+      pcs[i] = Blend16(m16[i], vx[i] == kk ? skip : next, pcs[i]);
+    }
+    return true;
+
+  case 0x4:
+    for (unsigned int i = 0; i < n; ++i) {
+      pcs[i] = Blend16(m16[i], vx[i] != kk ? skip : next, pcs[i]);
+    }
+    return true;
+
+  case 0x5:
+    for (unsigned int i = 0; i < n; ++i) {
+      pcs[i] = Blend16(m16[i], vx[i] == vy[i] ? skip : next, pcs[i]);
+    }
+    return true;
+
+  case 0x6:
+    for (unsigned int i = 0; i < n; ++i) {
+      vx[i] = Blend(m[i], kk, vx[i]);
+    }
+    break;
+
+  case 0x7:
+    for (unsigned int i = 0; i < n; ++i) {
+      vx[i] += kk & m[i];
+    }
+    break;
+
+  case 0x8:
+    switch (opcode & 0xF) {
+    case 0x0:
+      for (unsigned int i = 0; i < n; ++i) {
+        vx[i] = Blend(m[i], vy[i], vx[i]);
+      }
+      break;
+    case 0x1:
+      for (unsigned int i = 0; i < n; ++i) {
+        vx[i] = Blend(m[i], vx[i] | vy[i], vx[i]);
+      }
+      break;
+    case 0x2:
+      for (unsigned int i = 0; i < n; ++i) {
+        vx[i] = Blend(m[i], vx[i] & vy[i], vx[i]);
+      }
+      break;
+    case 0x3:
+      for (unsigned int i = 0; i < n; ++i) {
+        vx[i] = Blend(m[i], vx[i] ^ vy[i], vx[i]);
+      }
+      break;
+    case 0x4:
+      for (unsigned int i = 0; i < n; ++i) {
+        uint16_t sum = vx[i] + vy[i];
+        vx[i] = Blend(m[i], sum & 0xFF, vx[i]);
+        vf[i] = Blend(m[i], sum >> 8, vf[i]);
+      }
+      break;
+    case 0x5:
+      for (unsigned int i = 0; i < n; ++i) {
+        vf[i] = Blend(m[i], vx[i] < vy[i] ? 0 : 1, vf[i]);
+        vx[i] = Blend(m[i], vx[i] - vy[i], vx[i]);
+      }
+      break;
+    case 0x6:
+      for (unsigned int i = 0; i < n; ++i) {
+        vf[i] = Blend(m[i], shifted[i] & 1, vf[i]);
+        vx[i] = Blend(m[i], shifted[i] >> 1, vx[i]);
+      }
+      break;
+    case 0x7:
+      for (unsigned int i = 0; i < n; ++i) {
+        vf[i] = Blend(m[i], vy[i] < vx[i] ? 0 : 1, vf[i]);
+        vx[i] = Blend(m[i], vy[i] - vx[i], vx[i]);
+      }
+      break;
+    case 0xE:
+      for (unsigned int i = 0; i < n; ++i) {
+        vf[i] = Blend(m[i], (shifted[i] & 0x80u) >> 7, vf[i]);
+        vx[i] = Blend(m[i], shifted[i] << 1, vx[i]);
+      }
+      break;
+    default:
+      return false;
+    }
+    break;
+
+  case 0x9:
+    for (unsigned int i = 0; i < n; ++i) {
+      pcs[i] = Blend16(m16[i], vx[i] != vy[i] ? skip : next, pcs[i]);
+    }
+    return true;
+
+  case 0xA:
+    for (unsigned int i = 0; i < n; ++i) {
+      indexes[i] = Blend16(m16[i], nnn, indexes[i]);
+    }
+    break;
+
+  case 0xB:
+    for (unsigned int i = 0; i < n; ++i) {
+      pcs[i] = Blend16(m16[i], nnn + offset[i], pcs[i]);
+    }
+    return true;
+
+  case 0xF:
+    switch (kk) {
+    case 0x07:
+      for (unsigned int i = 0; i < n; ++i) {
+        vx[i] = Blend(m[i], delays[i], vx[i]);
+      }
+      break;
+    case 0x15:
+      for (unsigned int i = 0; i < n; ++i) {
+        delays[i] = Blend(m[i], vx[i], delays[i]);
+      }
+      break;
+    case 0x18:
+      for (unsigned int i = 0; i < n; ++i) {
+        sounds[i] = Blend(m[i], vx[i], sounds[i]);
+      }
+      break;
+    case 0x1E:
+      for (unsigned int i = 0; i < n; ++i) {
+        indexes[i] = Blend16(m16[i], indexes[i] + vx[i], indexes[i]);
+      }
+      break;
+    case 0x29:
+      for (unsigned int i = 0; i < n; ++i) {
+        indexes[i] =
+            Blend16(m16[i], vx[i] * 5 + FONTSET_START_ADDRESS, indexes[i]);
+      }
+      break;
+    default:
+      return false;
+    }
+    break;
+
+  default:
+    return false;
+  }
+
+  for (unsigned int i = 0; i < n; ++i) {
+    pcs[i] = Blend16(m16[i], next, pcs[i]);
+  }
+  return true;
+}
+
+// Run the next instruction of one lane through its Chip8
+void Chip8Lanes::ExecuteScalar(unsigned int lane) {
+  Chip8 &machine = machines[lane];
+
+  Store(lane);
+  machine.Run(1);
+  Load(lane);
+
+  if (machine.idle != IdleState::Running) {
+    idle[lane] = static_cast<uint8_t>(machine.idle);
+    budget[lane] = 0;
+  }
+}
+
+// Chip8::CheckIdleLoop() for the active lanes after a backward jump
+void Chip8Lanes::CheckIdleLoops(uint16_t jump) {
+  const uint8_t *m = active.data();
+  const unsigned int n = count;
+  uint8_t *same = matched.data();
+
+  const uint16_t *indexes = index.data();
+  const uint8_t *sps = sp.data();
+  const uint8_t *delays = delayTimer.data();
+  const uint8_t *sounds = soundTimer.data();
+  const uint32_t *effects = sideEffects.data();
+  uint8_t *taken = loopTaken.data();
+  uint32_t *snapEffects = loopSideEffects.data();
+  uint16_t *snapJump = loopJump.data();
+  uint16_t *snapIndex = loopIndex.data();
+  uint8_t *snapSp = loopSp.data();
+  uint8_t *snapDelay = loopDelayTimer.data();
+  uint8_t *snapSound = loopSoundTimer.data();
+
+  // One field per loop keeps each loop simple enough to vectorize
+  for (unsigned int i = 0; i < n; ++i) {
+    same[i] = m[i] & -taken[i];
+  }
+  for (unsigned int i = 0; i < n; ++i) {
+    same[i] &= -static_cast<uint8_t>(snapJump[i] == jump);
+  }
+  for (unsigned int i = 0; i < n; ++i) {
+    same[i] &= -static_cast<uint8_t>(snapEffects[i] == effects[i]);
+  }
+  for (unsigned int i = 0; i < n; ++i) {
+    same[i] &= -static_cast<uint8_t>(snapIndex[i] == indexes[i]);
+  }
+  for (unsigned int i = 0; i < n; ++i) {
+    same[i] &= -static_cast<uint8_t>((snapSp[i] == sps[i]) &
+                                     (snapDelay[i] == delays[i]) &
+                                     (snapSound[i] == sounds[i]));
+  }
+  for (unsigned int r = 0; r < 16; ++r) {
+    const uint8_t *v = Register(r);
+    const uint8_t *snapshot = &loopRegisters[r * n];
+    for (unsigned int i = 0; i < n; ++i) {
+      same[i] &= -static_cast<uint8_t>(v[i] == snapshot[i]);
+    }
+  }
+
+  // Idle lanes stop for this frame, the others take a new snapshot
+  uint8_t *idles = idle.data();
+  uint32_t *budgets = budget.data();
+  for (unsigned int i = 0; i < n; ++i) {
+    idles[i] = Blend(same[i], static_cast<uint8_t>(IdleState::UntilFrame),
+                     idles[i]);
+    budgets[i] = same[i] ? 0 : budgets[i];
+  }
+  uint8_t *record = matched.data(); // reused: lanes taking a new snapshot
+  for (unsigned int i = 0; i < n; ++i) {
+    record[i] = m[i] & ~same[i];
+  }
+  for (unsigned int i = 0; i < n; ++i) {
+    taken[i] |= record[i] & 1;
+    snapSp[i] = Blend(record[i], sps[i], snapSp[i]);
+    snapDelay[i] = Blend(record[i], delays[i], snapDelay[i]);
+    snapSound[i] = Blend(record[i], sounds[i], snapSound[i]);
+  }
+  for (unsigned int i = 0; i < n; ++i) {
+    uint16_t mask = -static_cast<uint16_t>(record[i] & 1);
+    snapJump[i] = Blend16(mask, jump, snapJump[i]);
+    snapIndex[i] = Blend16(mask, indexes[i], snapIndex[i]);
+  }
+  for (unsigned int i = 0; i < n; ++i) {
+    uint32_t mask = -static_cast<uint32_t>(record[i] & 1);
+    snapEffects[i] = (effects[i] & mask) | (snapEffects[i] & ~mask);
+  }
+  for (unsigned int r = 0; r < 16; ++r) {
+    const uint8_t *v = Register(r);
+    uint8_t *snapshot = &loopRegisters[r * n];
+    for (unsigned int i = 0; i < n; ++i) {
+      snapshot[i] = Blend(record[i], v[i], snapshot[i]);
+    }
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "chip8.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Runs many copies of one machine in lockstep, e.g. the same ROM with
+// different seeds and inputs. Registers, pc, I and the timers of all lanes
+// are stored structure-of-arrays, one array per field indexed by lane, so an
+// instruction that many lanes reach together is executed by one loop over
+// the lanes that the compiler turns into SIMD code.
+//
+// Each step runs the instruction at the lowest pc among the lanes with budget
+// left, masked to the lanes at that pc; lanes that branched elsewhere wait
+// and regroup when their pcs meet again. ALU, skip, jump and timer
+// instructions are executed on the arrays. Everything else (drawing, memory,
+// the stack, keys, Cxkk) runs through the lane's own Chip8 and its OP_*
+// handlers, so the lanes share those semantics exactly. Lanes whose code
+// differs from lane 0's are grouped by the instruction they actually hold.
+class Chip8Lanes {
+public:
+  // Every lane starts as a copy of 'machine'
+  Chip8Lanes(const Chip8 &machine, unsigned int lanes);
+
+  unsigned int Lanes() const { return count; }
+
+  void SetInstructionsPerFrame(unsigned int instructions) {
+    instructionsPerFrame = instructions;
+  }
+
+  // Change one lane's inputs between frames
+  void Seed(unsigned int lane, uint32_t seed) { machines[lane].Seed(seed); }
+  void SetKeys(unsigned int lane, uint16_t keys);
+
+  // Like Chip8::RunFrames() on every lane
+  void RunFrames(unsigned int frames);
+
+  // The lane as a Chip8, with the lockstep state written back. Use it to read
+  // results (StateHash(), video, ...); changes made through it are not seen
+  // by later RunFrames() calls.
+  Chip8 &Lane(unsigned int lane);
+
+  // Lane-instructions executed on the arrays and through the lanes' Chip8s
+  uint64_t LockstepInstructions() const { return lockstepInstructions; }
+  uint64_t ScalarInstructions() const { return scalarInstructions; }
+
+private:
+  unsigned int count;
+  unsigned int instructionsPerFrame;
+  QuirkFlags quirks; // of the machine the lanes were copied from
+  std::unique_ptr<Chip8[]> machines;
+
+  // Lane 0's memory is the shared code: the other lanes only run in
+  // lockstep with it at addresses whose page holds the same bytes.
+  std::vector<uint64_t> codePages; // pages where a lane's memory differs
+  unsigned int divergedLanes{};    // lanes with any such page
+
+  // Lockstep state, one entry per lane. Register r of lane i is at
+  // registers[r * count + i].
+  std::vector<uint8_t> registers;
+  std::vector<uint16_t> index;
+  std::vector<uint16_t> pc;
+  std::vector<uint8_t> delayTimer;
+  std::vector<uint8_t> soundTimer;
+  std::vector<uint32_t> budget;
+  std::vector<uint8_t> idle; // IdleState
+
+  // Copies of state owned by the lanes' Chip8s, for idle loop detection.
+  // Snapshots never outlive a frame, and a frame can't run 2^32 side
+  // effects, so the low 32 bits of the side effect count are enough.
+  std::vector<uint8_t> sp;
+  std::vector<uint32_t> sideEffects;
+
+  // Idle loop snapshots, as Chip8::LoopSnapshot. loopTaken replaces the frame
+  // number: it is cleared at the start of every frame.
+  std::vector<uint8_t> loopTaken;
+  std::vector<uint32_t> loopSideEffects;
+  std::vector<uint16_t> loopJump;
+  std::vector<uint16_t> loopIndex;
+  std::vector<uint8_t> loopSp;
+  std::vector<uint8_t> loopDelayTimer;
+  std::vector<uint8_t> loopSoundTimer;
+  std::vector<uint8_t> loopRegisters;
+
+  // 0xFF for the lanes taking part in the current step, 0 otherwise
+  std::vector<uint8_t> active;
+  std::vector<uint16_t> active16;
+  std::vector<uint8_t> matched; // scratch for CheckIdleLoops()
+
+  uint64_t lockstepInstructions{};
+  uint64_t scalarInstructions{};
+
+  uint8_t *Register(unsigned int r) { return &registers[r * count]; }
+
+  void RunBudget();
+  uint16_t Opcode(unsigned int lane, uint16_t address) const;
+  void SetActive(unsigned int lane) {
+    active[lane] = 0xFF;
+    active16[lane] = 0xFFFF;
+  }
+  void Execute(uint16_t address, uint16_t opcode);
+  bool ExecuteLockstep(uint16_t address, uint16_t opcode);
+  void ExecuteScalar(unsigned int lane);
+  void CheckIdleLoops(uint16_t jump);
+
+  // Move a lane's lockstep state into its Chip8 and back
+  void Store(unsigned int lane);
+  void Load(unsigned int lane);
+  void ComparePage(unsigned int lane, unsigned int page);
+};
@@ -0,0 +1,66 @@
+#include "latency.h"
+#include <algorithm>
+#include <iomanip>
+#include <string>
+
+namespace {
+
+// Width of the longest bar in the report
+const unsigned int BAR_WIDTH = 50;
+
+} // namespace
+
+void LatencyHistogram::Add(uint64_t nanoseconds) {
+  uint64_t bucket = std::min<uint64_t>(nanoseconds / 1000000, MAX_MILLISECONDS);
+  ++buckets[bucket];
+  ++count;
+  totalNanoseconds += nanoseconds;
+  minNanoseconds = std::min(minNanoseconds, nanoseconds);
+  maxNanoseconds = std::max(maxNanoseconds, nanoseconds);
+}
+
+double LatencyHistogram::Percentile(double fraction) const {
+  uint64_t target = uint64_t(fraction * count + 0.5);
+  uint64_t seen = 0;
+  for (unsigned int bucket = 0; bucket <= MAX_MILLISECONDS; ++bucket) {
+    seen += buckets[bucket];
+    if (seen >= target && seen > 0) {
+      // The last bucket is open-ended
+      return bucket == MAX_MILLISECONDS ? maxNanoseconds / 1e6 : bucket + 1.0;
+    }
+  }
+  return 0.0;
+}
+
+void LatencyHistogram::WriteReport(std::ostream &out) const {
+  out << "Input-to-display latency: " << count << " key events";
+  if (unanswered) {
+    out << ", " << unanswered << " without a visible response";
+  }
+  out << "\n";
+  if (count == 0) {
+    return;
+  }
+
+  out << std::fixed << std::setprecision(1);
+  out << "  min " << minNanoseconds / 1e6 << " ms, mean "
+      << totalNanoseconds / 1e6 / count << " ms, p50 <= " << Percentile(0.5)
+      << " ms, p90 <= " << Percentile(0.9) << " ms, p99 <= "
+      << Percentile(0.99) << " ms, max " << maxNanoseconds / 1e6 << " ms\n";
+  out.unsetf(std::ios::fixed);
+
+  uint64_t largest = *std::max_element(buckets, buckets + MAX_MILLISECONDS + 1);
+  for (unsigned int bucket = 0; bucket <= MAX_MILLISECONDS; ++bucket) {
+    if (buckets[bucket] == 0) {
+      continue;
+    }
+    unsigned int bar =
+        std::max<uint64_t>(1, buckets[bucket] * BAR_WIDTH / largest);
+    std::string range = std::to_string(bucket) +
+                        (bucket == MAX_MILLISECONDS
+                             ? "+"
+                             : "-" + std::to_string(bucket + 1));
+    out << "  " << std::setw(7) << range << " ms" << std::setw(8)
+        << buckets[bucket] << " " << std::string(bar, '#') << "\n";
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+// Histogram of input-to-display latencies with 1 ms buckets up to
+// MAX_MILLISECONDS; longer ones share the last bucket. Exact minimum, maximum
+// and mean are kept alongside, percentiles are read off the buckets.
+class LatencyHistogram {
+public:
+  static const unsigned int MAX_MILLISECONDS = 100;
+
+  void Add(uint64_t nanoseconds);
+
+  // A key event that never changed the display before it was given up on
+  void AddUnanswered() { ++unanswered; }
+
+  uint64_t Count() const { return count; }
+
+  // Upper bound of the bucket holding the given fraction (0..1) of samples
+  double Percentile(double fraction) const;
+
+  // Summary line and one bar per non-empty bucket
+  void WriteReport(std::ostream &out) const;
+
+private:
+  uint64_t buckets[MAX_MILLISECONDS + 1]{};
+  uint64_t count{};
+  uint64_t unanswered{};
+  uint64_t totalNanoseconds{};
+  uint64_t minNanoseconds = UINT64_MAX;
+  uint64_t maxNanoseconds{};
+};
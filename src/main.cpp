@@ -1,44 +1,294 @@
+#include "beeper.h"
 #include "chip8.h"
+#include "frame_stream.h"
+#include "latency.h"
+#include "movie.h"
 #include "platform.h"
+#include "rewind.h"
+#include "triple_buffer.h"
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Rewind history kept by the SDL frontend, enough for several minutes of
+// typical games
+const size_t REWIND_BUDGET = 4 << 20;
+
+// Key events that changed nothing on screen for this long are given up on
+const std::chrono::seconds LATENCY_TIMEOUT(1);
+
+// A completed frame handed from the emulation thread to the SDL thread
+struct Frame {
+  uint64_t video[VIDEO_WORDS];
+  unsigned int width;
+  unsigned int height;
+  uint32_t keyEvents; // key events in the keypad the frame was run with
+};
+
+// State shared between the SDL (main) thread and the emulation thread
+struct Shared {
+  TripleBuffer<Frame> frames;
+  // Bit n set while key n is down; above bit 16 the number of key events
+  // that led to this keypad, so frames can be matched to the input they saw
+  std::atomic<uint64_t> input{0};
+  std::atomic<bool> rewind{false};
+  std::atomic<bool> quit{false};
+};
+
+uint64_t PackInput(const uint8_t *keys, uint32_t keyEvents) {
+  uint64_t bits = uint64_t(keyEvents) << KEY_COUNT;
+  for (unsigned int i = 0; i < KEY_COUNT; ++i) {
+    bits |= (keys[i] ? 1u : 0u) << i;
+  }
+  return bits;
+}
+
+// Runs one emulated frame per 60 Hz tick, independent of the display, or
+// steps one frame back while rewinding. Key changes are picked up at the
+// start of the next frame; frames that changed the display are published to
+// the SDL thread, and to the frame stream when there is one. While recording
+// a movie every frame goes into it and rewind is disabled, since a movie can
+// only be played forward. The sound timer drives the beeper, with time
+// counted in instructions.
+void Emulate(Chip8 &chip8, Shared &shared, Beeper &beeper, Movie *movie,
+             FrameStreamWriter *stream) {
+  RewindBuffer history(REWIND_BUDGET);
+  uint64_t cycles = 0;
+  uint32_t frameNumber = 0; // 60 Hz frames since the start
+
+  const std::chrono::steady_clock::duration frameTime =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / 60.0));
+  auto nextFrame = std::chrono::steady_clock::now();
+
+  while (!shared.quit.load(std::memory_order_relaxed)) {
+    uint64_t input = shared.input.load(std::memory_order_relaxed);
+    for (unsigned int i = 0; i < KEY_COUNT; ++i) {
+      chip8.keypad[i] = (input >> i) & 1;
+    }
+
+    if (movie) {
+      chip8.RunFrames(1);
+      movie->Record(chip8);
+    } else if (shared.rewind.load(std::memory_order_relaxed)) {
+      history.StepBack(chip8);
+    } else {
+      chip8.RunFrames(1);
+      history.Record(chip8);
+    }
+
+    cycles += chip8.InstructionsPerFrame();
+    beeper.Update(cycles, chip8.SoundTimer() > 0);
+
+    if (chip8.TakeDirtyRows()) {
+      Frame &frame = shared.frames.Back();
+      std::memcpy(frame.video, chip8.video, sizeof(chip8.video));
+      frame.width = chip8.Width();
+      frame.height = chip8.Height();
+      frame.keyEvents = uint32_t(input >> KEY_COUNT);
+      shared.frames.Publish();
+      Platform::NotifyFrameReady();
+
+      if (stream) {
+        stream->Submit(chip8, frameNumber);
+      }
+    }
+    ++frameNumber;
+
+    // Don't try to catch up after a long stall
+    nextFrame += frameTime;
+    auto now = std::chrono::steady_clock::now();
+    if (nextFrame < now) {
+      nextFrame = now;
+    }
+    std::this_thread::sleep_until(nextFrame);
+  }
+}
+
+} // namespace
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    std::cerr << "Usage: " << argv[0] << " <Scale> <Delay> <ROM>\n";
+  char const *recordFilename = nullptr;
+  char const *keymap = nullptr;
+  char const *streamTarget = nullptr;
+  QuirkProfile quirks = QuirkProfile::Modern;
+  bool reportLatency = false;
+  int arg = 1;
+
+  for (; arg < argc && std::strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    if (std::strncmp(argv[arg], "--record=", 9) == 0) {
+      recordFilename = argv[arg] + 9;
+    } else if (std::strncmp(argv[arg], "--keys=", 7) == 0) {
+      keymap = argv[arg] + 7;
+    } else if (std::strncmp(argv[arg], "--stream=", 9) == 0) {
+      streamTarget = argv[arg] + 9;
+    } else if (std::strncmp(argv[arg], "--quirks=", 9) == 0) {
+      if (!ParseQuirkProfile(argv[arg] + 9, quirks)) {
+        std::cerr << "Unknown quirk profile: " << argv[arg] + 9 << "\n";
+        std::exit(EXIT_FAILURE);
+      }
+    } else if (std::strcmp(argv[arg], "--latency") == 0) {
+      reportLatency = true;
+    } else {
+      std::cerr << "Unknown option: " << argv[arg] << "\n";
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - arg != 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--record=Movie] [--keys=Layout] [--quirks=modern|vip|schip]"
+                 " [--stream=Target] [--latency] <Scale> <InstructionsPerFrame>"
+                 " <ROM>\n";
     std::exit(EXIT_FAILURE);
   }
 
-  int videoScale = std::stoi(argv[1]);
-  int cycleDelay = std::stoi(argv[2]);
-  char const *romFilename = argv[3];
+  int videoScale = std::stoi(argv[arg]);
+  int instructionsPerFrame = std::stoi(argv[arg + 1]);
+  char const *romFilename = argv[arg + 2];
+
+  // Outlives the Platform, which stops the audio callback using it
+  Beeper beeper(instructionsPerFrame * 60);
 
   Platform platform("CHIP-8 Emulator", VIDEO_WIDTH * videoScale,
                     VIDEO_HEIGHT * videoScale, VIDEO_WIDTH, VIDEO_HEIGHT);
+  if (keymap && !platform.SetKeymap(keymap)) {
+    std::cerr << "--keys needs 16 distinct keys for 0-F, e.g. "
+                 "x123qweasdzc4rfv\n";
+    std::exit(EXIT_FAILURE);
+  }
 
   Chip8 chip8;
-  chip8.LoadROM(romFilename);
+  chip8.SetQuirks(quirks);
+  std::vector<uint8_t> rom;
+  if (!ReadFile(romFilename, rom) || !chip8.LoadROM(rom.data(), rom.size())) {
+    std::exit(EXIT_FAILURE);
+  }
+  chip8.SetInstructionsPerFrame(instructionsPerFrame);
 
-  int videoPitch = sizeof(chip8.video[0]) * VIDEO_WIDTH;
+  // Movies need a known seed to be replayed
+  std::unique_ptr<Movie> movie;
+  if (recordFilename) {
+    uint32_t seed = std::chrono::system_clock::now().time_since_epoch().count();
+    chip8.Seed(seed);
+    movie.reset(new Movie);
+    movie->Begin(rom, seed, instructionsPerFrame, quirks);
+  }
+
+  // Frames also go out to a file, pipe or shared memory for other viewers
+  std::unique_ptr<FrameStreamWriter> stream;
+  if (streamTarget) {
+    std::unique_ptr<FrameSink> sink = OpenFrameSink(streamTarget);
+    if (!sink) {
+      std::exit(EXIT_FAILURE);
+    }
+    stream.reset(new FrameStreamWriter(std::move(sink)));
+  }
+
+  if (!platform.OpenAudio(beeper)) {
+    std::cerr << "No audio: " << SDL_GetError() << "\n";
+  }
 
-  auto lastCycleTime = std::chrono::high_resolution_clock::now();
+  Shared shared;
+  std::thread emulation(Emulate, std::ref(chip8), std::ref(shared),
+                        std::ref(beeper), movie.get(), stream.get());
+
+  // The SDL thread sleeps until there is input or a new frame, and always
+  // presents the newest frame, so a present blocked on vsync never holds up
+  // the emulation. Each key event is timed until the first changed frame
+  // run with it has been presented.
+  uint8_t keys[KEY_COUNT]{};
+  LatencyHistogram latency;
+  std::deque<std::chrono::steady_clock::time_point> pendingKeys;
+  uint32_t keyEvents = 0;
+  uint64_t presented[VIDEO_WORDS]{};
+  unsigned int width = VIDEO_WIDTH;
+  unsigned int height = VIDEO_HEIGHT;
   bool quit = false;
 
   while (!quit) {
-    quit = platform.ProcessInput(chip8.keypad);
+    quit = platform.WaitForInput(keys);
+    auto now = std::chrono::steady_clock::now();
+    for (; keyEvents != platform.KeyEvents(); ++keyEvents) {
+      pendingKeys.push_back(now);
+    }
+    shared.input.store(PackInput(keys, keyEvents), std::memory_order_relaxed);
+    shared.rewind.store(platform.RewindHeld(), std::memory_order_relaxed);
+
+    // Frames may have been skipped, so diff against what is on screen. A
+    // resolution change makes the Platform redraw everything.
+    uint64_t dirtyRows = 0;
+    uint32_t frameKeyEvents = 0;
+    if (shared.frames.Consume()) {
+      const Frame &frame = shared.frames.Front();
+      unsigned int words = frame.width / 64;
+      width = frame.width;
+      height = frame.height;
+      frameKeyEvents = frame.keyEvents;
+      for (unsigned int y = 0; y < height; ++y) {
+        const uint64_t *row = frame.video + y * words;
+        if (std::memcmp(row, presented + y * words, words * sizeof(*row))) {
+          dirtyRows |= 1ull << y;
+          std::memcpy(presented + y * words, row, words * sizeof(*row));
+        }
+      }
+    }
 
-    auto currentTime = std::chrono::high_resolution_clock::now();
-    float dt = std::chrono::duration<float, std::chrono::milliseconds::period>(
-                   currentTime - lastCycleTime)
-                   .count();
+    // Also repaints after window events when nothing changed
+    {
+#ifdef CHIP8_PROFILE
+      // Only this thread touches the present counters
+      Profile &profile = chip8.GetProfile();
+      ProfileTimer presentTimer(profile.presentNanoseconds, profile.presents);
+#endif
+      platform.Update(presented, width, height, dirtyRows);
+    }
 
-    if (dt > cycleDelay) {
-      lastCycleTime = currentTime;
+    // pendingKeys holds key events keyEvents - size() + 1 .. keyEvents
+    now = std::chrono::steady_clock::now();
+    uint32_t oldest = keyEvents - uint32_t(pendingKeys.size()) + 1;
+    for (; !pendingKeys.empty(); ++oldest) {
+      if (dirtyRows && int32_t(frameKeyEvents - oldest) >= 0) {
+        latency.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        now - pendingKeys.front())
+                        .count());
+      } else if (now - pendingKeys.front() > LATENCY_TIMEOUT) {
+        latency.AddUnanswered();
+      } else {
+        break;
+      }
+      pendingKeys.pop_front();
+    }
+  }
 
-      chip8.Cycle();
+  shared.quit.store(true);
+  emulation.join();
 
-      platform.Update(chip8.video, videoPitch);
+  if (stream) {
+    if (stream->Dropped()) {
+      std::cerr << "Frame stream dropped " << stream->Dropped()
+                << " frames\n";
     }
+    stream.reset();
+  }
+
+  if (reportLatency) {
+    latency.WriteReport(std::cout);
+  }
+
+#ifdef CHIP8_PROFILE
+  chip8.WriteProfile("chip8-profile");
+#endif
+
+  if (movie && !movie->Save(recordFilename)) {
+    return EXIT_FAILURE;
   }
 
   return 0;
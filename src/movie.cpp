@@ -0,0 +1,201 @@
+#include "movie.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+namespace {
+
+// Movie files: this header, the ROM, the key changes and the checkpoints,
+// all in host byte order. Bump MOVIE_VERSION whenever the format or the
+// hashed state changes.
+const char MOVIE_MAGIC[4] = {'C', '8', 'M', 'V'};
+const uint32_t MOVIE_VERSION = 3;
+
+struct MovieHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t seed;
+  uint32_t instructionsPerFrame;
+  uint32_t quirks;
+  uint32_t frames;
+  uint32_t romSize;
+  uint32_t keyChanges;
+  uint32_t checkpoints;
+};
+
+const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+// Only the words of the current resolution, the rest are always clear
+uint64_t HashVideo(uint64_t hash, const Chip8 &chip8) {
+  unsigned int words = chip8.Height() * chip8.RowWords();
+  for (unsigned int i = 0; i < words; ++i) {
+    hash = (hash ^ chip8.video[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+uint64_t CheckpointHash(uint64_t rolling, const Chip8 &chip8) {
+  return (rolling ^ chip8.StateHash()) * FNV_PRIME;
+}
+
+uint16_t PackKeys(const uint8_t *keypad) {
+  uint16_t keys = 0;
+  for (unsigned int i = 0; i < KEY_COUNT; ++i) {
+    keys |= (keypad[i] ? 1u : 0u) << i;
+  }
+  return keys;
+}
+
+template <typename T>
+void WriteArray(std::ofstream &file, const std::vector<T> &items) {
+  file.write(reinterpret_cast<const char *>(items.data()),
+             items.size() * sizeof(T));
+}
+
+template <typename T>
+void ReadArray(std::ifstream &file, std::vector<T> &items, uint32_t count) {
+  items.resize(count);
+  file.read(reinterpret_cast<char *>(items.data()), count * sizeof(T));
+}
+
+} // namespace
+
+void Movie::Begin(const std::vector<uint8_t> &rom, uint32_t seed,
+                  unsigned int instructionsPerFrame, QuirkProfile quirks) {
+  this->rom = rom;
+  this->seed = seed;
+  this->instructionsPerFrame = instructionsPerFrame;
+  this->quirks = quirks;
+  frames = 0;
+  keyChanges.clear();
+  checkpoints.clear();
+  lastKeys = 0;
+  rolling = FNV_OFFSET_BASIS;
+}
+
+void Movie::Record(const Chip8 &chip8) {
+  uint16_t keys = PackKeys(chip8.keypad);
+  if (keys != lastKeys) {
+    keyChanges.push_back(KeyChange{frames, keys, 0});
+    lastKeys = keys;
+  }
+
+  rolling = HashVideo(rolling, chip8);
+  ++frames;
+  if (frames % CHECKPOINT_INTERVAL == 0) {
+    checkpoints.push_back(
+        Checkpoint{frames, 0, CheckpointHash(rolling, chip8)});
+  }
+}
+
+bool Movie::Replay(Engine engine, uint32_t *mismatchFrame) const {
+  Chip8 chip8;
+  chip8.SetQuirks(quirks);
+  if (!chip8.LoadROM(rom.data(), rom.size())) {
+    *mismatchFrame = 0;
+    return false;
+  }
+  chip8.Seed(seed);
+  chip8.SetEngine(engine);
+  chip8.SetInstructionsPerFrame(instructionsPerFrame);
+
+  uint64_t hash = FNV_OFFSET_BASIS;
+  std::vector<KeyChange>::const_iterator change = keyChanges.begin();
+  std::vector<Checkpoint>::const_iterator checkpoint = checkpoints.begin();
+
+  for (uint32_t frame = 0; frame < frames; ++frame) {
+    if (change != keyChanges.end() && change->frame == frame) {
+      for (unsigned int i = 0; i < KEY_COUNT; ++i) {
+        chip8.keypad[i] = (change->keys >> i) & 1;
+      }
+      ++change;
+    }
+
+    chip8.RunFrames(1);
+
+    hash = HashVideo(hash, chip8);
+    if (checkpoint != checkpoints.end() && checkpoint->frame == frame + 1) {
+      if (checkpoint->hash != CheckpointHash(hash, chip8)) {
+        *mismatchFrame = checkpoint->frame;
+        return false;
+      }
+      ++checkpoint;
+    }
+  }
+  return true;
+}
+
+bool Movie::Save(char const *filename) const {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    std::cerr << "Failed to open movie: " << filename << "\n";
+    return false;
+  }
+
+  MovieHeader header;
+  std::memcpy(header.magic, MOVIE_MAGIC, sizeof(header.magic));
+  header.version = MOVIE_VERSION;
+  header.seed = seed;
+  header.instructionsPerFrame = instructionsPerFrame;
+  header.quirks = static_cast<uint32_t>(quirks);
+  header.frames = frames;
+  header.romSize = rom.size();
+  header.keyChanges = keyChanges.size();
+  header.checkpoints = checkpoints.size();
+
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  WriteArray(file, rom);
+  WriteArray(file, keyChanges);
+  WriteArray(file, checkpoints);
+  if (!file) {
+    std::cerr << "Failed to write movie: " << filename << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool Movie::Load(char const *filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Failed to open movie: " << filename << "\n";
+    return false;
+  }
+
+  MovieHeader header;
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!file ||
+      std::memcmp(header.magic, MOVIE_MAGIC, sizeof(MOVIE_MAGIC)) != 0 ||
+      header.version != MOVIE_VERSION || header.instructionsPerFrame == 0 ||
+      header.quirks > static_cast<uint32_t>(QuirkProfile::Schip) ||
+      header.romSize > MEMORY_SIZE || header.keyChanges > header.frames ||
+      header.checkpoints > header.frames / CHECKPOINT_INTERVAL) {
+    std::cerr << "Not a compatible movie: " << filename << "\n";
+    return false;
+  }
+
+  seed = header.seed;
+  instructionsPerFrame = header.instructionsPerFrame;
+  quirks = static_cast<QuirkProfile>(header.quirks);
+  frames = header.frames;
+  ReadArray(file, rom, header.romSize);
+  ReadArray(file, keyChanges, header.keyChanges);
+  ReadArray(file, checkpoints, header.checkpoints);
+  if (!file) {
+    std::cerr << "Truncated movie: " << filename << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool ReadFile(char const *filename, std::vector<uint8_t> &data) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Failed to open: " << filename << "\n";
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>(file),
+              std::istreambuf_iterator<char>());
+  return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "chip8.h"
+#include <cstdint>
+#include <vector>
+
+// A recorded play session: the ROM, the RNG seed, instructions per frame and
+// quirk profile it ran with, and every keypad change, which is all it takes
+// to run the session again exactly. Keys are only sampled between 60 Hz
+// frames, so a frame number is an exact timestamp (frame *
+// instructionsPerFrame cycles).
+//
+// Every frame folds the framebuffer into a rolling hash, and every
+// CHECKPOINT_INTERVAL frames the rolling hash combined with StateHash() is
+// stored, so a replay can tell within a second of game time where it
+// diverged.
+class Movie {
+public:
+  static const uint32_t CHECKPOINT_INTERVAL = 60;
+
+  struct KeyChange {
+    uint32_t frame; // the first frame run with these keys
+    uint16_t keys;  // bit n set while key n is down
+    uint16_t reserved;
+  };
+
+  struct Checkpoint {
+    uint32_t frame; // frames run before the hash was taken
+    uint32_t reserved;
+    uint64_t hash;
+  };
+
+  uint32_t seed{};
+  uint32_t instructionsPerFrame{DEFAULT_INSTRUCTIONS_PER_FRAME};
+  QuirkProfile quirks{QuirkProfile::Modern};
+  uint32_t frames{};
+  std::vector<uint8_t> rom;
+  std::vector<KeyChange> keyChanges;
+  std::vector<Checkpoint> checkpoints;
+
+  // Start a new recording. The machine being recorded must have loaded 'rom'
+  // with 'quirks' set and been seeded with 'seed'.
+  void Begin(const std::vector<uint8_t> &rom, uint32_t seed,
+             unsigned int instructionsPerFrame, QuirkProfile quirks);
+
+  // Record one frame: call after every RunFrames(1), with the keypad still
+  // holding the keys the frame ran with
+  void Record(const Chip8 &chip8);
+
+  // Run the movie on a fresh machine as fast as possible and compare every
+  // checkpoint. Returns false, with *mismatchFrame set to the first
+  // checkpoint that differs, if the run diverged.
+  bool Replay(Engine engine, uint32_t *mismatchFrame) const;
+
+  bool Save(char const *filename) const;
+  bool Load(char const *filename);
+
+private:
+  uint16_t lastKeys{};
+  uint64_t rolling{};
+};
+
+// Read a whole file, e.g. a ROM to record a movie of
+bool ReadFile(char const *filename, std::vector<uint8_t> &data);
@@ -1,10 +1,25 @@
 #include "platform.h"
+#include "framebuffer.h"
 #include <SDL2/SDL.h>
+#include <cctype>
+#include <cstring>
+
+namespace {
+
+// Keys 0-F on the left of a QWERTY keyboard, laid out like the COSMAC VIP's
+// hex keypad:
+//   1 2 3 C      1 2 3 4
+//   4 5 6 D  ->  q w e r
+//   7 8 9 E      a s d f
+//   A 0 B F      z x c v
+const char *const DEFAULT_KEYMAP = "x123qweasdzc4rfv";
+
+} // namespace
 
 Platform::Platform(char const *title, int windowWidth, int windowHeight,
                    int textureWidth, int textureHeight) {
-  // Initialize SDL with video support
-  SDL_Init(SDL_INIT_VIDEO);
+  // Initialize SDL with video and audio support
+  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
 
   // Create the SDL window (removed OpenGL flags)
   window = SDL_CreateWindow(
@@ -17,146 +32,187 @@ Platform::Platform(char const *title, int windowWidth, int windowHeight,
   renderer = SDL_CreateRenderer(
       window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
+  CreateTexture(textureWidth, textureHeight);
+  SetKeymap(DEFAULT_KEYMAP);
+}
+
+// (Re-)create the texture at the framebuffer's resolution. The window keeps
+// its size and the texture is stretched over it.
+void Platform::CreateTexture(int width, int height) {
+  if (texture) {
+    SDL_DestroyTexture(texture);
+  }
+  textureWidth = width;
+  textureHeight = height;
+  pixels.assign(width * height, PIXEL_OFF);
+
   // Create SDL Texture
   texture = SDL_CreateTexture(
       renderer,
       SDL_PIXELFORMAT_ABGR8888, // 32-bit RGBA pixel format
-      SDL_TEXTUREACCESS_STREAMING, textureWidth, textureHeight);
+      SDL_TEXTUREACCESS_STREAMING, width, height);
+
+  // Start from a blank screen, later updates only upload changed rows
+  SDL_UpdateTexture(texture, nullptr, pixels.data(),
+                    sizeof(pixels[0]) * width);
+  needsRedraw = true;
 }
 
 Platform::~Platform() {
+  if (audioDevice) {
+    SDL_CloseAudioDevice(audioDevice);
+  }
   SDL_DestroyTexture(texture);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
 }
 
-void Platform::Update(void const *buffer, int pitch) {
-  SDL_UpdateTexture(texture, nullptr, buffer, pitch);
+void Platform::Update(const uint64_t *video, int width, int height,
+                      uint64_t dirtyRows) {
+  if (width != textureWidth || height != textureHeight) {
+    CreateTexture(width, height);
+    dirtyRows = height < 64 ? (1ull << height) - 1 : ~0ull;
+  }
+
+  if (dirtyRows == 0 && !needsRedraw) {
+    return;
+  }
+  needsRedraw = false;
+
+  if (dirtyRows != 0) {
+    // Convert to ABGR only the span of rows that changed
+    int first = __builtin_ctzll(dirtyRows);
+    int last = 63 - __builtin_clzll(dirtyRows);
+    int count = last - first + 1;
+    int words = width / 64;
+
+    uint32_t *span = pixels.data() + first * textureWidth;
+    ExpandRows(video + first * words, count * words, span);
+
+    SDL_Rect rect{0, first, textureWidth, count};
+    int pitch = sizeof(pixels[0]) * textureWidth;
+    SDL_UpdateTexture(texture, &rect, span, pitch);
+  }
+
   SDL_RenderClear(renderer);
   SDL_RenderCopy(renderer, texture, nullptr, nullptr);
   SDL_RenderPresent(renderer);
 }
 
+namespace {
+
+// Samples per callback: 256 at 48 kHz is 5.3 ms
+const int AUDIO_RATE = 48000;
+const int AUDIO_SAMPLES = 256;
+
+void RenderAudio(void *userdata, Uint8 *stream, int len) {
+  static_cast<Beeper *>(userdata)->Render(reinterpret_cast<int16_t *>(stream),
+                                          len / sizeof(int16_t));
+}
+
+} // namespace
+
+bool Platform::OpenAudio(Beeper &beeper) {
+  SDL_AudioSpec desired{};
+  desired.freq = AUDIO_RATE;
+  desired.format = AUDIO_S16SYS;
+  desired.channels = 1;
+  desired.samples = AUDIO_SAMPLES;
+  desired.callback = RenderAudio;
+  desired.userdata = &beeper;
+
+  // Let SDL convert the format if the device wants another one, but take
+  // whatever rate it runs at
+  SDL_AudioSpec obtained;
+  audioDevice = SDL_OpenAudioDevice(nullptr, 0, &desired, &obtained,
+                                    SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (!audioDevice) {
+    return false;
+  }
+
+  beeper.SetSampleRate(obtained.freq);
+  SDL_PauseAudioDevice(audioDevice, 0);
+  return true;
+}
+
+bool Platform::SetKeymap(const char *layout) {
+  if (std::strlen(layout) != KEY_COUNT) {
+    return false;
+  }
+
+  int8_t table[SDL_NUM_SCANCODES];
+  std::memset(table, -1, sizeof(table));
+  for (unsigned int key = 0; key < KEY_COUNT; ++key) {
+    SDL_Scancode scancode = SDL_GetScancodeFromKey(
+        SDL_Keycode(std::tolower(static_cast<unsigned char>(layout[key]))));
+    if (scancode == SDL_SCANCODE_UNKNOWN || table[scancode] != -1) {
+      return false;
+    }
+    table[scancode] = key;
+  }
+
+  std::memcpy(keyOfScancode, table, sizeof(table));
+  return true;
+}
+
 bool Platform::ProcessInput(uint8_t *keys) {
   bool quit = false;
   SDL_Event event;
 
   while (SDL_PollEvent(&event)) {
-    switch (event.type) {
-    case SDL_QUIT:
+    quit = HandleEvent(event, keys) || quit;
+  }
+
+  return quit;
+}
+
+bool Platform::WaitForInput(uint8_t *keys) {
+  SDL_Event event;
+  bool quit = false;
+
+  if (SDL_WaitEvent(&event)) {
+    quit = HandleEvent(event, keys);
+  }
+
+  return ProcessInput(keys) || quit;
+}
+
+void Platform::NotifyFrameReady() {
+  SDL_Event event{};
+  event.type = SDL_USEREVENT;
+  SDL_PushEvent(&event);
+}
+
+bool Platform::HandleEvent(const SDL_Event &event, uint8_t *keys) {
+  bool quit = false;
+
+  switch (event.type) {
+  case SDL_QUIT:
+    quit = true;
+    break;
+
+  case SDL_WINDOWEVENT:
+    needsRedraw = true;
+    break;
+
+  case SDL_KEYDOWN:
+  case SDL_KEYUP: {
+    bool down = event.type == SDL_KEYDOWN;
+    if (down && event.key.keysym.sym == SDLK_ESCAPE) {
       quit = true;
-      break;
-
-    case SDL_KEYDOWN:
-      switch (event.key.keysym.sym) {
-      case SDLK_ESCAPE:
-        quit = true;
-        break;
-      case SDLK_x:
-        keys[0] = 1;
-        break;
-      case SDLK_1:
-        keys[1] = 1;
-        break;
-      case SDLK_2:
-        keys[2] = 1;
-        break;
-      case SDLK_3:
-        keys[3] = 1;
-        break;
-      case SDLK_q:
-        keys[4] = 1;
-        break;
-      case SDLK_w:
-        keys[5] = 1;
-        break;
-      case SDLK_e:
-        keys[6] = 1;
-        break;
-      case SDLK_a:
-        keys[7] = 1;
-        break;
-      case SDLK_s:
-        keys[8] = 1;
-        break;
-      case SDLK_d:
-        keys[9] = 1;
-        break;
-      case SDLK_z:
-        keys[0xA] = 1;
-        break;
-      case SDLK_c:
-        keys[0xB] = 1;
-        break;
-      case SDLK_4:
-        keys[0xC] = 1;
-        break;
-      case SDLK_r:
-        keys[0xD] = 1;
-        break;
-      case SDLK_f:
-        keys[0xE] = 1;
-        break;
-      case SDLK_v:
-        keys[0xF] = 1;
-        break;
-      }
-      break;
-
-    case SDL_KEYUP:
-      switch (event.key.keysym.sym) {
-      case SDLK_x:
-        keys[0] = 0;
-        break;
-      case SDLK_1:
-        keys[1] = 0;
-        break;
-      case SDLK_2:
-        keys[2] = 0;
-        break;
-      case SDLK_3:
-        keys[3] = 0;
-        break;
-      case SDLK_q:
-        keys[4] = 0;
-        break;
-      case SDLK_w:
-        keys[5] = 0;
-        break;
-      case SDLK_e:
-        keys[6] = 0;
-        break;
-      case SDLK_a:
-        keys[7] = 0;
-        break;
-      case SDLK_s:
-        keys[8] = 0;
-        break;
-      case SDLK_d:
-        keys[9] = 0;
-        break;
-      case SDLK_z:
-        keys[0xA] = 0;
-        break;
-      case SDLK_c:
-        keys[0xB] = 0;
-        break;
-      case SDLK_4:
-        keys[0xC] = 0;
-        break;
-      case SDLK_r:
-        keys[0xD] = 0;
-        break;
-      case SDLK_f:
-        keys[0xE] = 0;
-        break;
-      case SDLK_v:
-        keys[0xF] = 0;
-        break;
-      }
-      break;
+    } else if (event.key.keysym.sym == SDLK_BACKSPACE) {
+      rewindHeld = down;
     }
+
+    // Auto-repeat doesn't change the keypad
+    int key = keyOfScancode[event.key.keysym.scancode];
+    if (key >= 0 && !event.key.repeat && keys[key] != down) {
+      keys[key] = down;
+      ++keyEvents;
+    }
+    break;
+  }
   }
 
   return quit;
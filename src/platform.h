@@ -1,7 +1,10 @@
 #pragma once
 
+#include "beeper.h"
+#include "chip8.h"
 #include <SDL2/SDL.h>
 #include <cstdint>
+#include <vector>
 
 class Platform {
 public:
@@ -9,11 +12,54 @@ public:
            int textureWidth, int textureHeight);
   ~Platform();
 
-  void Update(const void *buffer, int pitch);
+  // Present a packed 1-bit framebuffer (width / 64 words per row). Only the
+  // span of rows set in dirtyRows is converted and uploaded; when no row is
+  // dirty and the window does not need repainting nothing is presented. A
+  // new width or height re-creates the texture and uploads every row.
+  void Update(const uint64_t *video, int width, int height,
+              uint64_t dirtyRows);
   bool ProcessInput(uint8_t *keys);
 
+  // Block until at least one event arrives, then handle it like ProcessInput
+  bool WaitForInput(uint8_t *keys);
+
+  // Wake a thread blocked in WaitForInput; safe to call from any thread
+  static void NotifyFrameReady();
+
+  // Start playing 'beeper' on the default audio device, with a buffer of a
+  // few milliseconds. Returns false (and stays silent) without a device.
+  bool OpenAudio(Beeper &beeper);
+
+  // True while the rewind key (Backspace) is held down
+  bool RewindHeld() const { return rewindHeld; }
+
+  // Map CHIP-8 keys 0-F, in order, to the keyboard keys typing 'layout' in
+  // the current keyboard layout. Returns false, keeping the old map, unless
+  // it is 16 distinct keys.
+  bool SetKeymap(const char *layout);
+
+  // Number of CHIP-8 key presses and releases handled so far
+  uint32_t KeyEvents() const { return keyEvents; }
+
 private:
+  void CreateTexture(int width, int height);
+  bool HandleEvent(const SDL_Event &event, uint8_t *keys);
+
   SDL_Window *window{};
   SDL_Renderer *renderer{};
   SDL_Texture *texture{};
+  SDL_AudioDeviceID audioDevice{};
+
+  // ABGR staging buffer, filled from the packed framebuffer on present
+  std::vector<uint32_t> pixels;
+  int textureWidth{};
+  int textureHeight{};
+
+  // Set when the window was exposed or resized and must be presented again
+  bool needsRedraw = true;
+  bool rewindHeld = false;
+
+  // CHIP-8 key of each scancode, or -1
+  int8_t keyOfScancode[SDL_NUM_SCANCODES];
+  uint32_t keyEvents{};
 };
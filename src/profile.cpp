@@ -0,0 +1,161 @@
+#include "profile.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Number of addresses listed in the report
+const unsigned int HOTSPOTS = 20;
+
+// Name of the handler that runs 'opcode', as in Chip8::OP_*
+const char *HandlerName(uint16_t opcode) {
+  static const char *const main[16] = {
+      nullptr,   "OP_1nnn", "OP_2nnn", "OP_3xkk", "OP_4xkk", "OP_5xy0",
+      "OP_6xkk", "OP_7xkk", nullptr,   "OP_9xy0", "OP_Annn", "OP_Bnnn",
+      "OP_Cxkk", "OP_Dxyn", nullptr,   nullptr};
+  uint8_t low = opcode & 0xFF;
+
+  switch (opcode >> 12) {
+  case 0x0:
+    return opcode == 0x00E0 ? "OP_00E0" : opcode == 0x00EE ? "OP_00EE"
+                                                           : "OP_NULL";
+  case 0x8: {
+    static const char *const alu[16] = {
+        "OP_8xy0", "OP_8xy1", "OP_8xy2", "OP_8xy3", "OP_8xy4", "OP_8xy5",
+        "OP_8xy6", "OP_8xy7", nullptr,   nullptr,   nullptr,   nullptr,
+        nullptr,   nullptr,   "OP_8xyE", nullptr};
+    const char *name = alu[opcode & 0xF];
+    return name ? name : "OP_NULL";
+  }
+  case 0xE:
+    return low == 0x9E ? "OP_Ex9E" : low == 0xA1 ? "OP_ExA1" : "OP_NULL";
+  case 0xF:
+    switch (low) {
+    case 0x07:
+      return "OP_Fx07";
+    case 0x0A:
+      return "OP_Fx0A";
+    case 0x15:
+      return "OP_Fx15";
+    case 0x18:
+      return "OP_Fx18";
+    case 0x1E:
+      return "OP_Fx1E";
+    case 0x29:
+      return "OP_Fx29";
+    case 0x33:
+      return "OP_Fx33";
+    case 0x55:
+      return "OP_Fx55";
+    case 0x65:
+      return "OP_Fx65";
+    default:
+      return "OP_NULL";
+    }
+  default:
+    return main[opcode >> 12];
+  }
+}
+
+std::string Hex(unsigned int value, int digits) {
+  char text[8];
+  std::snprintf(text, sizeof(text), "%0*X", digits, value);
+  return text;
+}
+
+double Percent(uint64_t part, uint64_t total) {
+  return total ? 100.0 * part / total : 0.0;
+}
+
+} // namespace
+
+void Profile::WriteReport(std::ostream &out) const {
+  std::vector<std::pair<uint64_t, std::string>> handlers;
+  uint64_t total = 0;
+  for (unsigned int opcode = 0; opcode < 65536; ++opcode) {
+    if (opcodeCounts[opcode] == 0) {
+      continue;
+    }
+    total += opcodeCounts[opcode];
+    std::string name = HandlerName(opcode);
+    auto it = std::find_if(handlers.begin(), handlers.end(),
+                           [&name](const std::pair<uint64_t, std::string> &h) {
+                             return h.second == name;
+                           });
+    if (it == handlers.end()) {
+      handlers.emplace_back(opcodeCounts[opcode], name);
+    } else {
+      it->first += opcodeCounts[opcode];
+    }
+  }
+  std::sort(handlers.rbegin(), handlers.rend());
+
+  std::vector<std::pair<uint64_t, unsigned int>> hotspots;
+  for (unsigned int address = 0; address < ADDRESSES; ++address) {
+    if (addressCounts[address] != 0) {
+      hotspots.emplace_back(addressCounts[address], address);
+    }
+  }
+  std::sort(hotspots.rbegin(), hotspots.rend());
+  if (hotspots.size() > HOTSPOTS) {
+    hotspots.resize(HOTSPOTS);
+  }
+
+  out << std::fixed << std::setprecision(2);
+  out << total << " instructions\n\nInstructions per handler:\n";
+  for (const std::pair<uint64_t, std::string> &handler : handlers) {
+    out << "  " << std::left << std::setw(10) << handler.second << std::right
+        << std::setw(16) << handler.first << std::setw(8)
+        << Percent(handler.first, total) << "%\n";
+  }
+
+  out << "\nHottest addresses:\n";
+  for (const std::pair<uint64_t, unsigned int> &hotspot : hotspots) {
+    out << "  0x" << Hex(hotspot.second, 3) << std::setw(16) << hotspot.first
+        << std::setw(8) << Percent(hotspot.first, total) << "%\n";
+  }
+
+  out << "\nDraw (Dxyn): " << draws << " calls, " << drawNanoseconds / 1e6
+      << " ms";
+  if (draws) {
+    out << ", " << double(drawNanoseconds) / draws << " ns each";
+  }
+  out << "\nPresent: " << presents << " frames, " << presentNanoseconds / 1e6
+      << " ms";
+  if (presents) {
+    out << ", " << double(presentNanoseconds) / presents / 1e3 << " us each";
+  }
+  out << "\n";
+  out.unsetf(std::ios::fixed);
+}
+
+void Profile::WriteCollapsed(std::ostream &out, const uint8_t *memory) const {
+  for (unsigned int address = 0; address < ADDRESSES; ++address) {
+    if (addressCounts[address] == 0) {
+      continue;
+    }
+    uint16_t opcode = (memory[address] << 8) |
+                      memory[(address + 1) & (ADDRESSES - 1)];
+    out << HandlerName(opcode) << ";0x" << Hex(address, 3) << " "
+        << addressCounts[address] << "\n";
+  }
+}
+
+bool Profile::Write(const char *prefix, const uint8_t *memory) const {
+  std::string base = prefix;
+  std::ofstream report(base + ".txt");
+  std::ofstream collapsed(base + ".folded");
+  WriteReport(report);
+  WriteCollapsed(collapsed, memory);
+  if (!report || !collapsed) {
+    std::cerr << "Failed to write profile: " << base << ".txt/.folded\n";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Execution profile gathered by profiling builds (cmake -DCHIP8_PROFILE=ON).
+// Every executed instruction bumps the counter of its address and of its
+// opcode, so the handler mix is recovered at report time without classifying
+// anything on the hot path. Other builds compile the counting out entirely.
+struct Profile {
+  static const unsigned int ADDRESSES = 4096;
+
+  uint64_t addressCounts[ADDRESSES]{};
+  uint64_t opcodeCounts[65536]{};
+
+  // Wall-clock time spent in Dxyn, and in presenting frames (added by the
+  // frontend, which owns the presenter)
+  uint64_t drawNanoseconds{};
+  uint64_t draws{};
+  uint64_t presentNanoseconds{};
+  uint64_t presents{};
+
+  void Count(uint16_t address, uint16_t opcode) {
+    ++addressCounts[address];
+    ++opcodeCounts[opcode];
+  }
+
+  // Sorted text report: instructions per handler, the hottest addresses and
+  // the draw and present times
+  void WriteReport(std::ostream &out) const;
+
+  // One "handler;address count" line per executed address, the collapsed
+  // stack format read by flamegraph.pl and speedscope
+  void WriteCollapsed(std::ostream &out, const uint8_t *memory) const;
+
+  // Write <prefix>.txt and <prefix>.folded
+  bool Write(const char *prefix, const uint8_t *memory) const;
+};
+
+// Adds the lifetime of a scope to a nanosecond counter
+class ProfileTimer {
+public:
+  ProfileTimer(uint64_t &nanoseconds, uint64_t &count)
+      : nanoseconds(nanoseconds), start(std::chrono::steady_clock::now()) {
+    ++count;
+  }
+
+  ~ProfileTimer() {
+    nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  }
+
+private:
+  uint64_t &nanoseconds;
+  std::chrono::steady_clock::time_point start;
+};
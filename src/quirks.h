@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstring>
+
+// Behaviours that CHIP-8 interpreters disagree on and that ROMs depend on.
+// Each profile is a policy type whose constants the handlers test, so every
+// check folds away at compile time: Chip8 instantiates its quirk-dependent
+// handlers and dispatch loops once per profile and picks the set to use when
+// the profile is set, not per instruction.
+//
+// Modern is what this emulator always did and stays the default. Vip is the
+// original COSMAC VIP interpreter and Schip SUPER-CHIP 1.1 on the HP 48.
+enum class QuirkProfile { Modern, Vip, Schip };
+
+struct ModernQuirks {
+  // 8xy6/8xyE shift Vy into Vx instead of shifting Vx in place
+  static const bool shiftUsesVy = false;
+  // Fx55/Fx65 leave I pointing past the last register stored or loaded
+  static const bool loadStoreIncrementsIndex = false;
+  // Dxyn clips sprites at the screen edges instead of wrapping them around
+  static const bool clipSprites = false;
+  // Bnnn jumps to nnn + Vx, x being the high nibble of nnn, instead of V0
+  static const bool jumpUsesVx = false;
+};
+
+struct VipQuirks {
+  static const bool shiftUsesVy = true;
+  static const bool loadStoreIncrementsIndex = true;
+  static const bool clipSprites = true;
+  static const bool jumpUsesVx = false;
+};
+
+struct SchipQuirks {
+  static const bool shiftUsesVy = false;
+  static const bool loadStoreIncrementsIndex = false;
+  static const bool clipSprites = true;
+  static const bool jumpUsesVx = true;
+};
+
+// The same constants as run-time values, for code that looks at them once
+// per translation or per lockstep instruction rather than in a handler
+struct QuirkFlags {
+  bool shiftUsesVy;
+  bool loadStoreIncrementsIndex;
+  bool clipSprites;
+  bool jumpUsesVx;
+};
+
+template <typename Quirks> QuirkFlags MakeQuirkFlags() {
+  return QuirkFlags{Quirks::shiftUsesVy, Quirks::loadStoreIncrementsIndex,
+                    Quirks::clipSprites, Quirks::jumpUsesVx};
+}
+
+inline QuirkFlags GetQuirkFlags(QuirkProfile profile) {
+  switch (profile) {
+  case QuirkProfile::Vip:
+    return MakeQuirkFlags<VipQuirks>();
+  case QuirkProfile::Schip:
+    return MakeQuirkFlags<SchipQuirks>();
+  default:
+    return MakeQuirkFlags<ModernQuirks>();
+  }
+}
+
+inline const char *QuirkProfileName(QuirkProfile profile) {
+  switch (profile) {
+  case QuirkProfile::Vip:
+    return "vip";
+  case QuirkProfile::Schip:
+    return "schip";
+  default:
+    return "modern";
+  }
+}
+
+// "modern", "vip" or "schip"; returns false for anything else
+inline bool ParseQuirkProfile(const char *name, QuirkProfile &profile) {
+  const QuirkProfile profiles[] = {QuirkProfile::Modern, QuirkProfile::Vip,
+                                   QuirkProfile::Schip};
+  for (QuirkProfile p : profiles) {
+    if (std::strcmp(name, QuirkProfileName(p)) == 0) {
+      profile = p;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,182 @@
+#include "rewind.h"
+#include <cstddef>
+#include <cstring>
+
+namespace {
+
+const size_t STATE_SIZE = sizeof(Chip8State);
+const size_t MEMORY_OFFSET = offsetof(Chip8State, memory);
+
+// A delta is a sequence of (unchanged bytes, changed bytes) runs: two 16-bit
+// lengths followed by the XOR of the changed bytes.
+static_assert(STATE_SIZE <= 0xFFFF, "run lengths are 16-bit");
+
+// Fewer unchanged bytes than this are cheaper to keep inside a literal run
+// than to split it with another header
+const size_t MIN_UNCHANGED_RUN = 4;
+
+class DeltaEncoder {
+public:
+  DeltaEncoder(const uint8_t *from, const uint8_t *to, uint64_t dirtyPages)
+      : from(from), to(to), dirtyPages(dirtyPages) {}
+
+  void Encode(std::vector<uint8_t> &out) const {
+    out.clear();
+    size_t i = 0;
+
+    while (i < STATE_SIZE) {
+      size_t unchanged = i;
+      while (i < STATE_SIZE) {
+        if (CleanPage(i)) {
+          i = (i - MEMORY_OFFSET) / MEMORY_PAGE_SIZE * MEMORY_PAGE_SIZE +
+              MEMORY_PAGE_SIZE + MEMORY_OFFSET;
+        } else if (from[i] == to[i]) {
+          ++i;
+        } else {
+          break;
+        }
+      }
+      unchanged = i - unchanged;
+
+      size_t start = i;
+      while (i < STATE_SIZE) {
+        size_t run = 0;
+        while (run < MIN_UNCHANGED_RUN && i + run < STATE_SIZE &&
+               Unchanged(i + run)) {
+          ++run;
+        }
+        if (run == MIN_UNCHANGED_RUN || i + run == STATE_SIZE) {
+          break;
+        }
+        i += run + 1;
+      }
+
+      if (i == start) {
+        break; // only unchanged bytes left
+      }
+
+      uint16_t lengths[2] = {static_cast<uint16_t>(unchanged),
+                             static_cast<uint16_t>(i - start)};
+      const uint8_t *header = reinterpret_cast<const uint8_t *>(lengths);
+      out.insert(out.end(), header, header + sizeof(lengths));
+      for (size_t k = start; k < i; ++k) {
+        out.push_back(from[k] ^ to[k]);
+      }
+    }
+  }
+
+private:
+  const uint8_t *from;
+  const uint8_t *to;
+  uint64_t dirtyPages;
+
+  // Byte i lies on a memory page that was not written since the last frame
+  bool CleanPage(size_t i) const {
+    if (i < MEMORY_OFFSET || i >= MEMORY_OFFSET + MEMORY_SIZE) {
+      return false;
+    }
+    return !((dirtyPages >> ((i - MEMORY_OFFSET) / MEMORY_PAGE_SIZE)) & 1);
+  }
+
+  bool Unchanged(size_t i) const { return CleanPage(i) || from[i] == to[i]; }
+};
+
+void ApplyDelta(const uint8_t *delta, size_t size, uint8_t *state) {
+  const uint8_t *end = delta + size;
+  size_t i = 0;
+
+  while (delta < end) {
+    uint16_t lengths[2];
+    std::memcpy(lengths, delta, sizeof(lengths));
+    delta += sizeof(lengths);
+
+    i += lengths[0];
+    for (uint16_t k = 0; k < lengths[1]; ++k) {
+      state[i++] ^= *delta++;
+    }
+  }
+}
+
+} // namespace
+
+RewindBuffer::RewindBuffer(size_t budget) : ring(budget) {
+  encoded.reserve(2 * STATE_SIZE);
+}
+
+void RewindBuffer::Clear() {
+  deltas.clear();
+  head = 0;
+  used = 0;
+  recorded = false;
+}
+
+void RewindBuffer::Record(Chip8 &chip8) {
+  uint64_t dirtyPages = chip8.TakeDirtyPages();
+  Chip8State &next = states[newest ^ 1];
+  chip8.SaveState(next);
+
+  if (recorded) {
+    // Stored backwards: applying it to the new state gives the previous one
+    DeltaEncoder(reinterpret_cast<const uint8_t *>(&states[newest]),
+                 reinterpret_cast<const uint8_t *>(&next), dirtyPages)
+        .Encode(encoded);
+    Push(encoded);
+  }
+
+  newest ^= 1;
+  recorded = true;
+}
+
+void RewindBuffer::Push(const std::vector<uint8_t> &delta) {
+  size_t size = delta.size();
+  if (size > ring.size()) {
+    // Can't be stored, and the frames before it can't be reached without it
+    deltas.clear();
+    head = 0;
+    used = 0;
+    return;
+  }
+
+  // Deltas at or after 'head' are from the previous pass over the ring and
+  // are the oldest. Wrapping drops those left at the end of the ring.
+  if (head + size > ring.size()) {
+    while (!deltas.empty() && deltas.front().offset >= head) {
+      used -= deltas.front().size;
+      deltas.pop_front();
+    }
+    head = 0;
+  }
+
+  while (!deltas.empty() && deltas.front().offset >= head &&
+         deltas.front().offset < head + size) {
+    used -= deltas.front().size;
+    deltas.pop_front();
+  }
+
+  if (size > 0) {
+    std::memcpy(ring.data() + head, delta.data(), size);
+  }
+  deltas.push_back(Delta{head, size});
+  head += size;
+  used += size;
+}
+
+bool RewindBuffer::StepBack(Chip8 &chip8) {
+  if (deltas.empty()) {
+    return false;
+  }
+
+  Delta delta = deltas.back();
+  deltas.pop_back();
+  head = delta.offset;
+  used -= delta.size;
+
+  Chip8State &state = states[newest];
+  ApplyDelta(ring.data() + delta.offset, delta.size,
+             reinterpret_cast<uint8_t *>(&state));
+  chip8.LoadState(state);
+
+  // The machine now matches the newest frame again
+  chip8.TakeDirtyPages();
+  return true;
+}
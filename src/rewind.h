@@ -0,0 +1,51 @@
+#pragma once
+
+#include "chip8.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Frame history for rewinding. The newest recorded frame is kept as a full
+// Chip8State; every earlier frame is a reverse delta in a fixed-size byte
+// ring: the XOR of two consecutive states, run-length encoded so that the
+// bytes a frame did not touch (most of memory and the framebuffer) cost next
+// to nothing. When the ring is full the oldest frames are dropped, so memory
+// use is the budget plus two Chip8States.
+class RewindBuffer {
+public:
+  explicit RewindBuffer(size_t budget);
+
+  // Record the machine's current state as the newest frame. Takes the dirty
+  // memory pages from chip8, so memory pages nobody wrote are not compared.
+  void Record(Chip8 &chip8);
+
+  // Restore the frame recorded before the newest one, which then becomes the
+  // newest. Returns false when there is no earlier frame.
+  bool StepBack(Chip8 &chip8);
+
+  void Clear();
+
+  // Number of times StepBack() can succeed
+  size_t Frames() const { return deltas.size(); }
+  size_t BytesUsed() const { return used; }
+  size_t Budget() const { return ring.size(); }
+
+private:
+  struct Delta {
+    size_t offset;
+    size_t size;
+  };
+
+  std::vector<uint8_t> ring;
+  std::deque<Delta> deltas; // oldest first, laid out in ring order
+  size_t head{};            // where the next delta is written
+  size_t used{};
+
+  Chip8State states[2];
+  unsigned int newest{};
+  bool recorded = false;
+  std::vector<uint8_t> encoded; // scratch for the delta being recorded
+
+  void Push(const std::vector<uint8_t> &delta);
+};
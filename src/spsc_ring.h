@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Lock-free bounded single producer / single consumer queue. Neither side
+// ever blocks or allocates: TryPush() fails when the ring is full and TryPop()
+// when it is empty. Capacity must be a power of two.
+template <typename T, size_t Capacity> class SpscRing {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+public:
+  // Producer side
+  bool TryPush(const T &item) {
+    size_t tail = writeIndex.load(std::memory_order_relaxed);
+    if (tail - readIndex.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    items[tail & (Capacity - 1)] = item;
+    writeIndex.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Peek() returns null when the ring is empty; the item stays
+  // valid until Pop().
+  const T *Peek() const {
+    size_t head = readIndex.load(std::memory_order_relaxed);
+    if (head == writeIndex.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &items[head & (Capacity - 1)];
+  }
+
+  void Pop() {
+    readIndex.store(readIndex.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+  }
+
+  bool TryPop(T &item) {
+    const T *front = Peek();
+    if (!front) {
+      return false;
+    }
+    item = *front;
+    Pop();
+    return true;
+  }
+
+private:
+  T items[Capacity]{};
+
+  // Free-running counters, kept on separate cache lines so the two threads
+  // don't invalidate each other's line on every operation
+  alignas(64) std::atomic<size_t> writeIndex{0};
+  alignas(64) std::atomic<size_t> readIndex{0};
+};
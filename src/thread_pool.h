@@ -0,0 +1,82 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running submitted tasks. Wait() blocks until
+// every task submitted so far has finished, which lets a caller run a batch
+// in parallel and then touch the same objects again without further locking.
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned int threads) {
+    if (threads == 0) {
+      threads = 1;
+    }
+    for (unsigned int i = 0; i < threads; ++i) {
+      workers.emplace_back(&ThreadPool::Work, this);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void Submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+      ++pending;
+    }
+    wake.notify_one();
+  }
+
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pending == 0; });
+  }
+
+  unsigned int Size() const { return workers.size(); }
+
+private:
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable wake; // tasks were queued, or stopping
+  std::condition_variable done; // pending dropped to zero
+  unsigned int pending = 0;     // queued plus running
+  bool stopping = false;
+
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+      if (tasks.empty()) {
+        return; // stopping
+      }
+
+      std::function<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+
+      if (--pending == 0) {
+        done.notify_all();
+      }
+    }
+  }
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free single producer / single consumer triple buffer. The producer
+// always has a buffer to write into and never waits; the consumer always
+// reads the most recently published buffer and never waits. Intermediate
+// buffers the consumer did not get to are dropped.
+template <typename T> class TripleBuffer {
+public:
+  // Producer side: fill Back(), then Publish() it
+  T &Back() { return buffers[back]; }
+
+  void Publish() {
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Consumer side: Consume() returns true when a newer buffer than the one
+  // in Front() was published, and makes it the new Front()
+  bool Consume() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+      return false;
+    }
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  const T &Front() const { return buffers[front]; }
+
+private:
+  static const uint8_t INDEX = 0x3;
+  static const uint8_t FRESH = 0x4;
+
+  T buffers[3]{};
+  uint8_t back = 0;
+  uint8_t front = 1;
+  std::atomic<uint8_t> middle{2}; // index of the shared buffer | FRESH
+};